@@ -0,0 +1,217 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// 一筆 access log，固定大小，直接複製進 ring buffer
+struct access_record {
+    char method[8];
+    char uri[256];          // 太長就截斷
+    char remote[48];
+    int status = 0;
+    long long bytes = -1;   // -1: 不知道 (CGI 直接寫 socket)
+    long long latency_us = 0;
+    int pid = 0;            // 0: 不是 CGI
+    int exit_status = -1;   // exit code，被 signal 殺掉是 128+signo
+    time_t time = 0;
+
+    access_record() {
+        method[0] = uri[0] = remote[0] = '\0';
+    }
+
+    static void copy(char* dst, size_t n, const std::string& src) {
+        size_t len = std::min(n - 1, src.size());
+        std::memcpy(dst, src.data(), len);
+        dst[len] = '\0';
+    }
+};
+
+// bounded MPSC ring：每個 slot 有自己的 sequence，producer 用 CAS 搶位置，不會被 consumer 擋住
+template <typename T, size_t N>
+class mpsc_ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    mpsc_ring() : slots_(new slot[N]) {
+        for (size_t i = 0; i < N; ++i)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    // 滿了回傳 false，呼叫端自己決定要不要丟掉
+    bool try_push(const T& value) {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            slot& s = slots_[pos & (N - 1)];
+            size_t seq = s.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    s.value = value;
+                    s.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 只能由單一 consumer 呼叫
+    bool try_pop(T& out) {
+        slot& s = slots_[tail_ & (N - 1)];
+        size_t seq = s.seq.load(std::memory_order_acquire);
+        if (static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(tail_ + 1) < 0)
+            return false;
+        out = s.value;
+        s.seq.store(tail_ + N, std::memory_order_release);
+        ++tail_;
+        return true;
+    }
+
+private:
+    struct slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+    std::unique_ptr<slot[]> slots_;
+    std::atomic<size_t> head_{0};
+    size_t tail_ = 0;
+};
+
+// access log writer：io_context thread 只做 try_push，格式化、write、rotate 都在獨立的 thread
+//
+// 每行一筆，欄位以空白分隔，方便用 awk 算 latency 分佈：
+//   time remote method uri status bytes latency_us pid exit
+// 不適用的欄位寫 "-"
+class access_logger {
+public:
+    static constexpr size_t ring_size = 4096;
+    static constexpr size_t batch_max = 256;
+    static constexpr int histogram_buckets = 32; // bucket i: latency < 2^i us
+
+    access_logger(std::string path, size_t max_bytes)
+        : path_(std::move(path)), max_bytes_(max_bytes) {
+        open_file();
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~access_logger() {
+        stop_.store(true);
+        thread_.join();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    void log(const access_record& rec) {
+        if (!ring_.try_push(rec)) dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 下一輪由 logger thread 把 latency histogram 印到 stderr
+    void request_histogram() { histogram_requested_.store(true); }
+
+private:
+    void run() {
+        std::string out;
+        access_record rec;
+        for (;;) {
+            bool stopping = stop_.load();
+            size_t n = 0;
+            out.clear();
+            while (n < batch_max && ring_.try_pop(rec)) {
+                format(rec, out);
+                ++n;
+            }
+            if (n > 0) write_batch(out);
+            if (histogram_requested_.exchange(false)) print_histogram();
+            if (n == batch_max) continue;    // 還有積壓，馬上再取
+            if (stopping) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    void format(const access_record& r, std::string& out) {
+        char when[32];
+        struct tm tm;
+        gmtime_r(&r.time, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+        char line[512];
+        int len = snprintf(line, sizeof(line), "%s %s %s %s %d ",
+                           when, r.remote, r.method, r.uri, r.status);
+        out.append(line, std::min<size_t>(len, sizeof(line) - 1));
+        out += r.bytes < 0 ? "-" : std::to_string(r.bytes);
+        out += ' ';
+        out += std::to_string(r.latency_us);
+        out += ' ';
+        out += r.pid ? std::to_string(r.pid) : "-";
+        out += ' ';
+        out += r.exit_status < 0 ? "-" : std::to_string(r.exit_status);
+        out += '\n';
+
+        int bucket = 0;
+        while (bucket < histogram_buckets - 1 && (1LL << bucket) <= r.latency_us) ++bucket;
+        ++histogram_[bucket];
+    }
+
+    void write_batch(const std::string& out) {
+        if (fd_ < 0) return;
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t n = ::write(fd_, out.data() + done, out.size() - done);
+            if (n <= 0) break;
+            done += n;
+        }
+        written_ += done;
+        if (written_ >= max_bytes_) rotate();
+    }
+
+    // 超過大小就把目前的檔案改名成 .1，重新開一個
+    void rotate() {
+        ::close(fd_);
+        std::string old = path_ + ".1";
+        std::rename(path_.c_str(), old.c_str());
+        open_file();
+    }
+
+    void open_file() {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st;
+        written_ = (fd_ >= 0 && ::fstat(fd_, &st) == 0) ? st.st_size : 0;
+        if (fd_ < 0) std::cerr << "access log: cannot open " << path_ << std::endl;
+    }
+
+    void print_histogram() {
+        std::string line = "latency_us";
+        for (int i = 0; i < histogram_buckets; ++i) {
+            if (histogram_[i] == 0) continue;
+            line += " <" + std::to_string(1LL << i) + ":" + std::to_string(histogram_[i]);
+        }
+        line += " dropped:" + std::to_string(dropped_.load()) + "\n";
+        ::write(STDERR_FILENO, line.data(), line.size());
+    }
+
+    std::string path_;
+    size_t max_bytes_;
+    int fd_ = -1;
+    size_t written_ = 0;
+    unsigned long long histogram_[histogram_buckets] = {};
+    mpsc_ring<access_record, ring_size> ring_;
+    std::atomic<unsigned long long> dropped_{0};
+    std::atomic<bool> histogram_requested_{false};
+    std::atomic<bool> stop_{false};
+    std::thread thread_;
+};
+
+#endif
@@ -8,13 +8,38 @@
 #include <sstream>
 #include <fstream>
 #include <array>
+#include <deque>
 #include <functional>
+#include <algorithm>
+#include <cctype>
+#include <mutex>
+#include <thread>
 #include <boost/asio.hpp>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include "escape.h"
+#include "health.h"
+#include "script_cache.h"
 
 using boost::asio::ip::tcp;
 
 // 最大支援 5 組 Session
 constexpr int MAX_SESSIONS = 5;
+// 給瀏覽器的輸出累積超過 HIGH 就暫停讀遠端，降到 LOW 再繼續；超過 MAX 直接斷線
+constexpr size_t OUTBOX_HIGH   = 256 * 1024;
+constexpr size_t OUTBOX_LOW    = 64 * 1024;
+constexpr size_t OUTBOX_MAX    = 1024 * 1024;
+constexpr size_t OUTBOX_GATHER = 64;    // 一次 async_write 最多合併幾段
+// SSE：遠端的輸出先累積，最多等 SSE_FLUSH_INTERVAL 或累積 SSE_FLUSH_BYTES 才合成一個 frame；
+// 單一 session 累積到 SSE_SESSION_BUDGET 也馬上送（跟 console.cgi 的 Output 一樣）
+constexpr auto   SSE_FLUSH_INTERVAL = std::chrono::milliseconds(50);
+constexpr size_t SSE_FLUSH_BYTES    = 64 * 1024;
+constexpr size_t SSE_SESSION_BUDGET = 16 * 1024;
 // 可選主機清單
 const std::vector<std::string> HOSTS = []{
     std::vector<std::string> v;
@@ -22,29 +47,224 @@ const std::vector<std::string> HOSTS = []{
         v.push_back("nplinux"+std::to_string(i)+".cs.nycu.edu.tw");
     return v;
 }();
-// 可選測試檔案清單
+// 可選測試檔案清單，test_case/ 讀不到時才用
 const std::vector<std::string> TEST_FILES = {
     "t1.txt","t2.txt","t3.txt","t4.txt","t5.txt"
 };
 
-// HTML escape，用於安全地送入 innerHTML
-static std::string html_escape(const std::string& src) {
-    std::string out; out.reserve(src.size()*2);
-    for(char c: src) {
-        switch(c) {
-            case '&':  out += "&amp;";      break;
-            case '<':  out += "&lt;";       break;
-            case '>':  out += "&gt;";       break;
-            case '"':  out += "&quot;";     break;
-            case '\'': out += "&#39;";      break;
-            case '\n': out += "&NewLine;";  break;
-            case '\r': break;
-            default:   out += c;
+// test_case/ 底下的檔案，照名稱排序
+static std::vector<std::string> scan_test_files() {
+    std::vector<std::string> files;
+    DIR* dir = opendir("test_case");
+    if(!dir) return TEST_FILES;
+    while(dirent* e = readdir(dir)) {
+        std::string name = e->d_name;
+        if(name.empty() || name[0] == '.') continue;
+        files.push_back(name);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// panel 的 HTML 本體，不含 HTTP header
+static std::string render_panel(const std::vector<std::string>& files) {
+    std::ostringstream oss;
+    oss << R"(
+<!DOCTYPE html><html lang="en"><head>
+  <meta charset="UTF-8"><title>NP Project4 Panel</title>
+  <link rel="stylesheet"
+    href="https://cdn.jsdelivr.net/npm/bootstrap@4.5.3/dist/css/bootstrap.min.css">
+  <style>*{font-family:'Source Code Pro',monospace;}</style>
+</head><body class="bg-secondary pt-5">
+  <form action="console.cgi" method="GET">
+    <table class="table mx-auto bg-light" style="width: inherit">
+      <thead class="thead-dark">
+        <tr><th>#</th><th>Host</th><th>Port</th><th>Input File</th></tr>
+      </thead><tbody>)";
+
+    for(int i = 0; i < MAX_SESSIONS; ++i) {
+        oss << "<tr><th>Session " << (i+1) << "</th><td>"
+               R"(<div class="input-group"><select name="h)" << i << R"(" class="custom-select"><option></option>)";
+
+        for (auto& fqdn : HOSTS) {
+            auto pos = fqdn.find('.');
+            std::string prefix = (pos == std::string::npos ? fqdn : fqdn.substr(0, pos));
+            oss << "<option value=\"" << fqdn << "\">" << prefix << "</option>";
         }
+
+        oss << R"(</select><div class="input-group-append">
+                     <span class="input-group-text">.cs.nycu.edu.tw</span>
+                   </div></div></td>
+                   <td><input name="p)" << i << R"(" type="text"
+                     class="form-control" size="5"/></td>
+                   <td><select name="f)" << i << R"(" class="custom-select">
+                     <option></option>)";
+
+        for (auto& f : files) {
+            std::string name = html_escape(f);
+            oss << "<option value=\"" << name << "\">" << name << "</option>";
+        }
+
+        oss << R"(</select></td></tr>)";
     }
-    return out;
+
+    oss << R"(
+      <tr><td colspan="3"></td>
+          <td><button type="submit"
+            class="btn btn-info btn-block">Run</button>
+          </td>
+      </tr>
+    </tbody></table>
+  </form>
+</body></html>)";
+    return oss.str();
+}
+
+// Accept-Encoding 是逗號分隔的 coding[;q=x]：gzip / x-gzip 的 q 要大於 0 才算；
+// 沒提到 gzip 時看 "*"
+static bool accepts_gzip(const std::string& value) {
+    double gzip_q = -1, star_q = -1;
+    std::istringstream list(value);
+    std::string item;
+    while(std::getline(list, item, ',')) {
+        std::string coding = item.substr(0, item.find(';'));
+        coding.erase(0, coding.find_first_not_of(" \t"));
+        coding.erase(coding.find_last_not_of(" \t") + 1);
+        std::transform(coding.begin(), coding.end(), coding.begin(),
+                       [](unsigned char c){ return std::tolower(c); });
+        double q = 1;
+        auto semi = item.find(';');
+        if(semi != std::string::npos) {
+            std::string param = item.substr(semi + 1);
+            param.erase(0, param.find_first_not_of(" \t"));
+            if(param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+                q = std::atof(param.c_str() + 2);
+        }
+        if(coding == "gzip" || coding == "x-gzip") gzip_q = std::max(gzip_q, q);
+        else if(coding == "*")                     star_q = q;
+    }
+    return gzip_q >= 0 ? gzip_q > 0 : star_q > 0;
 }
 
+static std::string gzip_compress(const std::string& in) {
+    z_stream zs{};
+    // windowBits 15+16: 輸出 gzip header 而不是 zlib
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+        return std::string();
+    std::string out(deflateBound(&zs, in.size()), '\0');
+    zs.next_in   = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in  = static_cast<uInt>(in.size());
+    zs.next_out  = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? out : std::string();
+}
+
+// 算好的 panel 回應，header 跟 body 放在同一個 buffer，一次 write 送完
+// 兩種 encoding 的 body 不同，各自一個 strong ETag（gzip 的多 -gz）和一個 304
+struct PanelPage {
+    std::string etag, etag_gzip;
+    std::string plain;          // 完整 HTTP 回應
+    std::string gzip;           // Content-Encoding: gzip 版本，壓縮失敗就是空的
+    std::string not_modified, not_modified_gzip;
+};
+
+// panel 只有 test_case/ 內容或 HOSTS 變了才需要重畫。
+// Linux 用 inotify 看 test_case/，其他平台（或 watch 失敗時）比對目錄 mtime。
+class PanelCache {
+public:
+    PanelCache() {
+#ifdef __linux__
+        notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if(notify_fd_ >= 0 &&
+           inotify_add_watch(notify_fd_, "test_case",
+               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+               IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+            close(notify_fd_);
+            notify_fd_ = -1;
+        }
+#endif
+    }
+
+    std::shared_ptr<const PanelPage> get() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(!page_ || changed()) page_ = build();
+        return page_;
+    }
+
+private:
+    std::mutex mutex_;
+    std::shared_ptr<const PanelPage> page_;
+    time_t dir_mtime_ = 0;
+    int notify_fd_ = -1;
+
+    bool changed() {
+#ifdef __linux__
+        if(notify_fd_ >= 0) {
+            char events[4096];
+            bool any = false;
+            while(read(notify_fd_, events, sizeof(events)) > 0) any = true;
+            return any;
+        }
+#endif
+        struct stat st;
+        time_t mtime = stat("test_case", &st) == 0 ? st.st_mtime : 0;
+        if(mtime == dir_mtime_) return false;
+        dir_mtime_ = mtime;
+        return true;
+    }
+
+    std::shared_ptr<const PanelPage> build() {
+        struct stat st;
+        dir_mtime_ = stat("test_case", &st) == 0 ? st.st_mtime : 0;
+
+        std::string body = render_panel(scan_test_files());
+        // FNV-1a，只是拿來當 ETag
+        unsigned long long h = 1469598103934665603ULL;
+        for(unsigned char c : body) { h ^= c; h *= 1099511628211ULL; }
+        std::ostringstream tag;
+        tag << std::hex << h;
+
+        auto page = std::make_shared<PanelPage>();
+        page->etag      = '"' + tag.str() + '"';
+        page->etag_gzip = '"' + tag.str() + "-gz\"";
+        auto common = [](const std::string& etag) {
+            return "Content-Type: text/html\r\n"
+                   "ETag: " + etag + "\r\n"
+                   "Vary: Accept-Encoding\r\n"
+                   "Connection: close\r\n";
+        };
+        auto not_modified = [](const std::string& etag) {
+            return "HTTP/1.1 304 Not Modified\r\n"
+                   "ETag: " + etag + "\r\n"
+                   "Vary: Accept-Encoding\r\n"
+                   "Connection: close\r\n\r\n";
+        };
+        page->plain = "HTTP/1.1 200 OK\r\n" + common(page->etag) +
+                      "Content-Length: " + std::to_string(body.size()) +
+                      "\r\n\r\n" + body;
+        page->not_modified = not_modified(page->etag);
+        std::string gz = gzip_compress(body);
+        if(!gz.empty()) {
+            page->gzip = "HTTP/1.1 200 OK\r\n" + common(page->etag_gzip) +
+                         "Content-Encoding: gzip\r\n"
+                         "Content-Length: " + std::to_string(gz.size()) +
+                         "\r\n\r\n" + gz;
+            page->not_modified_gzip = not_modified(page->etag_gzip);
+        }
+        return page;
+    }
+};
+
+static PanelCache panel_cache;
+
+// 連不上的 host:port 記在記憶體裡，之後的 console 請求直接跳過
+static health_table host_health;
+
 // 解析 QUERY_STRING 中的 h0..h4, p0..p4, f0..f4
 struct Target { std::string host, port, file; };
 static std::vector<Target> parse_query(const std::string& qs) {
@@ -70,37 +290,187 @@ static std::vector<Target> parse_query(const std::string& qs) {
     return out;
 }
 
+// mode=sse: 只回頁面，頁面再用 EventSource 連 mode=events 拿輸出；沒有就是原本的 <script> 模式
+static std::string query_mode(const std::string& qs) {
+    std::istringstream ss(qs);
+    std::string token;
+    while(std::getline(ss, token, '&'))
+        if(token.compare(0, 5, "mode=") == 0) return token.substr(5);
+    return std::string();
+}
+
+// 跟 console.cgi 相同的 SSE client：data 是 [{"s":i,"k":"o"|"c","d":"..."},...]
+static const char SSE_CLIENT[] = R"(<script>
+  var es=new EventSource(location.search.replace('mode=sse','mode=events'));
+  es.onmessage=function(e){var f=JSON.parse(e.data);
+    for(var j=0;j<f.length;++j){var p=document.getElementById('s'+f[j].s),n;
+      if(f[j].k=='c'){n=document.createElement('b');n.textContent=f[j].d;}
+      else n=document.createTextNode(f[j].d);
+      p.appendChild(n);}};
+  es.addEventListener('end',function(){es.close();});
+</script>)";
+
 class HttpSession;
 using HttpSessionPtr = std::shared_ptr<HttpSession>;
 
-// 處理單線程 HTTP client 連線
+// 處理一個 HTTP client 連線。
+// 這個連線跟它底下所有 RemoteSession 的 handler 都跑在同一個 strand_ 上，
+// 所以 io_context 開多條 thread 時，同一個 browser 的狀態不需要另外上鎖
 class HttpSession : public std::enable_shared_from_this<HttpSession> {
 public:
-    HttpSession(tcp::socket sock, boost::asio::io_context& io)
+    using strand_type = boost::asio::strand<boost::asio::any_io_executor>;
+
+    explicit HttpSession(tcp::socket sock)
       : socket_(std::move(sock))
       , strand_(socket_.get_executor())
-      , io_ctx_(io)
+      , sse_timer_(strand_)
     {}
 
     // 開始讀 HTTP 請求
     void start() { do_read_header(); }
 
     // 提供給 RemoteSession 呼叫，將 script push 回 browser
-    void deliver(const std::string& msg) {
+    // 排進 outbox，同一時間只有一個 async_write，前一個寫完再把累積的一起送。
+    // 任何 thread 都可以呼叫；已經在 strand_ 上時 dispatch 會直接執行
+    void deliver(std::string&& msg) {
         auto self = shared_from_this();
-        boost::asio::async_write(socket_,
-            boost::asio::buffer(msg),
-            boost::asio::bind_executor(strand_,
-            [self](auto,auto){})
-        );
+        boost::asio::dispatch(strand_,
+            [this,self,msg = std::move(msg)]() mutable {
+                enqueue(std::move(msg));
+            });
+    }
+
+    // 以下只給 RemoteSession 在 strand_ 上呼叫
+    bool sse() const { return sse_; }
+
+    // 最後一個 RemoteSession 結束時送 end event，不然 EventSource 會自己重連
+    void remote_done() {
+        if(--remotes_ == 0 && sse_) {
+            sse_flush();
+            enqueue("event: end\ndata:\n\n");
+        }
+    }
+
+    // SSE：escape 直接接在這個 session 累積的內容後面；同種（o/c）連續的輸出併成同一個 entry
+    void sse_append(int id, char kind, const std::string& txt) {
+        std::string& p = sse_pending_[id];
+        if(sse_kind_[id] != kind) {
+            if(sse_kind_[id]) p += "\"},";
+            p += "{\"s\":" + std::to_string(id) + ",\"k\":\"";
+            p += kind;
+            p += "\",\"d\":\"";
+            sse_kind_[id] = kind;
+        }
+        json_escape_append(p, txt);
+        sse_buffered_ += txt.size();
+        if(sse_buffered_ >= SSE_FLUSH_BYTES || p.size() >= SSE_SESSION_BUDGET) {
+            sse_flush();
+        } else if(!sse_armed_) {
+            sse_armed_ = true;
+            auto self = shared_from_this();
+            sse_timer_.expires_after(SSE_FLUSH_INTERVAL);
+            sse_timer_.async_wait([this,self](boost::system::error_code ec){
+                if(!ec) sse_flush();
+            });
+        }
+    }
+
+    // browser 跟不上時 RemoteSession 先別讀，等 outbox 消化再叫它
+    bool congested() const { return outbox_bytes_ >= OUTBOX_HIGH; }
+    void when_writable(std::function<void()> resume) {
+        if(!broken_) paused_.push_back(std::move(resume));
     }
 
 private:
+    void enqueue(std::string&& msg) {
+        if(broken_) return;
+        outbox_bytes_ += msg.size();
+        outbox_.push_back(std::move(msg));
+        if(outbox_bytes_ > OUTBOX_MAX) {
+            // 瀏覽器完全不讀，放棄這條連線
+            close_outbox();
+            return;
+        }
+        if(!writing_) do_write();
+    }
+
     tcp::socket socket_;
-    boost::asio::strand<boost::asio::any_io_executor> strand_;
-    boost::asio::io_context& io_ctx_;
+    strand_type strand_;
     std::array<char, 8192> buffer_;
     std::string request_;
+    std::string host_hdr_, if_none_match_;
+    bool accept_gzip_ = false;
+    bool sse_ = false;
+    size_t remotes_ = 0;
+    std::deque<std::string> outbox_;    // push_back 不會搬動已在寫的字串
+    size_t outbox_bytes_ = 0;
+    bool writing_ = false;
+    bool broken_ = false;
+    std::vector<std::function<void()>> paused_;
+    // SSE 還沒送出的內容，每個 RemoteSession 一格
+    boost::asio::steady_timer sse_timer_;
+    bool sse_armed_ = false;
+    std::vector<std::string> sse_pending_;
+    std::vector<char> sse_kind_;            // 各 session 目前開著的 entry 種類，0 表示沒有
+    size_t sse_buffered_ = 0;
+
+    // 所有 session 累積的內容合成一個 data: [...] frame
+    void sse_flush() {
+        if(sse_buffered_ == 0) return;
+        sse_timer_.cancel();
+        sse_armed_ = false;
+        std::string frame = "data: [";
+        bool first = true;
+        for(auto& p : sse_pending_) {
+            if(p.empty()) continue;
+            if(!first) frame += ',';
+            frame += p;
+            frame += "\"}";
+            p.clear();
+            first = false;
+        }
+        frame += "]\n\n";
+        std::fill(sse_kind_.begin(), sse_kind_.end(), '\0');
+        sse_buffered_ = 0;
+        enqueue(std::move(frame));
+    }
+
+    void do_write() {
+        writing_ = true;
+        size_t count = std::min(outbox_.size(), OUTBOX_GATHER);
+        std::vector<boost::asio::const_buffer> bufs;
+        bufs.reserve(count);
+        for(size_t i = 0; i < count; ++i)
+            bufs.push_back(boost::asio::buffer(outbox_[i]));
+
+        auto self = shared_from_this();
+        boost::asio::async_write(socket_, bufs,
+            boost::asio::bind_executor(strand_,
+            [this,self,count](boost::system::error_code ec, std::size_t){
+                writing_ = false;
+                if(ec) { close_outbox(); return; }
+                for(size_t i = 0; i < count; ++i) {
+                    outbox_bytes_ -= outbox_.front().size();
+                    outbox_.pop_front();
+                }
+                if(!outbox_.empty()) do_write();
+                if(outbox_bytes_ <= OUTBOX_LOW && !paused_.empty()) {
+                    auto resume = std::move(paused_);
+                    paused_.clear();
+                    for(auto& fn : resume) fn();
+                }
+            }));
+    }
+
+    // 不再送任何東西；丟掉等待中的 RemoteSession，它們的連線也會跟著關掉
+    void close_outbox() {
+        broken_ = true;
+        outbox_.clear();
+        outbox_bytes_ = 0;
+        paused_.clear();
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
 
     // 非同步讀到 header 結尾
     void do_read_header() {
@@ -127,17 +497,24 @@ private:
             return;
         }
 
-        // 讀 Host header
-        std::string line, host_hdr;
+        // 讀 header：Host 之外 panel 還需要 If-None-Match / Accept-Encoding
+        std::string line;
         std::getline(iss, line); // skip rest of request line
         while(std::getline(iss, line) && line != "\r") {
-            if(line.rfind("Host:",0) == 0) {
-                host_hdr = line.substr(5);
-                auto p = host_hdr.find_first_not_of(" \t");
-                host_hdr = host_hdr.substr(p);
-                while(!host_hdr.empty() && (host_hdr.back()=='\r' || host_hdr.back()=='\n'))
-                    host_hdr.pop_back();
-            }
+            auto colon = line.find(':');
+            if(colon == std::string::npos) continue;
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(),
+                           [](unsigned char c){ return std::tolower(c); });
+            std::string value = line.substr(colon + 1);
+            auto p = value.find_first_not_of(" \t");
+            value = (p == std::string::npos) ? "" : value.substr(p);
+            while(!value.empty() && (value.back()=='\r' || value.back()=='\n'))
+                value.pop_back();
+            if(name == "host")               host_hdr_ = value;
+            else if(name == "if-none-match") if_none_match_ = value;
+            else if(name == "accept-encoding")
+                accept_gzip_ = accepts_gzip(value);
         }
 
         // 分離 path 和 query
@@ -159,66 +536,41 @@ private:
         }
     }
 
-// panel.cgi：輸出完整表單，並關 socket
-void handle_panel() {
-    std::ostringstream oss;
-    oss << "HTTP/1.1 200 OK\r\n"
-        << "Content-Type: text/html\r\n\r\n"
-        << R"(
-<!DOCTYPE html><html lang="en"><head>
-  <meta charset="UTF-8"><title>NP Project4 Panel</title>
-  <link rel="stylesheet"
-    href="https://cdn.jsdelivr.net/npm/bootstrap@4.5.3/dist/css/bootstrap.min.css">
-  <style>*{font-family:'Source Code Pro',monospace;}</style>
-</head><body class="bg-secondary pt-5">
-  <form action="console.cgi" method="GET">
-    <table class="table mx-auto bg-light" style="width: inherit">
-      <thead class="thead-dark">
-        <tr><th>#</th><th>Host</th><th>Port</th><th>Input File</th></tr>
-      </thead><tbody>)";
+    // panel.cgi：直接送 cache 裡算好的回應，並關 socket
+    void handle_panel() {
+        auto page = panel_cache.get();
+        // 先決定送哪個 encoding，If-None-Match 只跟那個 encoding 的 ETag 比
+        bool gz = accept_gzip_ && !page->gzip.empty();
+        const std::string& etag = gz ? page->etag_gzip : page->etag;
+        const std::string* out = gz ? &page->gzip : &page->plain;
+        if(!if_none_match_.empty() &&
+           (if_none_match_ == "*" ||
+            if_none_match_.find(etag) != std::string::npos))
+            out = gz ? &page->not_modified_gzip : &page->not_modified;
 
-    for(int i = 0; i < MAX_SESSIONS; ++i) {
-        oss << "<tr><th>Session " << (i+1) << "</th><td>"
-               R"(<div class="input-group"><select name="h)" << i << R"(" class="custom-select"><option></option>)";
-
-        for (auto& fqdn : HOSTS) {
-            auto pos = fqdn.find('.');
-            std::string prefix = (pos == std::string::npos ? fqdn : fqdn.substr(0, pos));
-            oss << "<option value=\"" << fqdn << "\">" << prefix << "</option>";
-        }
-
-        oss << R"(</select><div class="input-group-append">
-                     <span class="input-group-text">.cs.nycu.edu.tw</span>
-                   </div></div></td>
-                   <td><input name="p)" << i << R"(" type="text"
-                     class="form-control" size="5"/></td>
-                   <td><select name="f)" << i << R"(" class="custom-select">
-                     <option></option>)";
-
-        for (auto& f : TEST_FILES) {
-            oss << "<option value=\"" << f << "\">" << f << "</option>";
-        }
-
-        oss << R"(</select></td></tr>)";
+        // page 綁在 callback 裡，寫完之前 buffer 不會被換掉
+        auto self = shared_from_this();
+        boost::asio::async_write(socket_,
+            boost::asio::buffer(*out),
+            boost::asio::bind_executor(strand_,
+            [self,page](auto,auto){
+                self->socket_.close();
+            }));
     }
 
-    oss << R"(
-      <tr><td colspan="3"></td>
-          <td><button type="submit"
-            class="btn btn-info btn-block">Run</button>
-          </td>
-      </tr>
-    </tbody></table>
-  </form>
-</body></html>)";
-
-    send_response(oss.str());
-}
-
-
     // console.cgi：先寫出 table skeleton，但不關 socket
     void handle_console(const std::string& qs) {
         auto targets = parse_query(qs);
+        std::string mode = query_mode(qs);
+        if(mode == "events") {
+            sse_ = true;
+            enqueue("HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/event-stream\r\n"
+                    "Cache-Control: no-cache\r\n\r\n");
+            start_remotes(targets);
+            return;
+        }
+
         std::ostringstream oss;
         oss << "HTTP/1.1 200 OK\r\n"
             << "Content-Type: text/html\r\n\r\n"
@@ -231,7 +583,9 @@ void handle_panel() {
            font-family:'Source Code Pro',monospace;}
          table{width:100%;}b{color:#01b468;}
          pre{margin:0;white-space:pre-wrap;color:#f1f3f5;}</style>
-</head><body>
+</head><body>)";
+        if(mode == "sse") oss << SSE_CLIENT;
+        oss << R"(
 <table class="table table-dark table-bordered">
   <thead><tr>)";
         for(size_t i=0; i<targets.size(); ++i)
@@ -242,31 +596,37 @@ void handle_panel() {
         oss << R"(</tr></tbody></table>
         </body></html>)";                     
 
-        // 非同步寫 skeleton，**不**關 socket
-        auto self = shared_from_this();
-        std::string skeleton = oss.str();
-        boost::asio::async_write(socket_,
-            boost::asio::buffer(skeleton),
-            boost::asio::bind_executor(strand_,
-            [this,self,targets = std::move(targets)]
-            (boost::system::error_code ec, std::size_t){
-                if(ec) return;
-                // skeleton 寫完後，啟動各遠端 Session
-                for(size_t i=0; i<targets.size(); ++i) {
-                    std::make_shared<RemoteSession>(
-                        io_ctx_, int(i), shared_from_this(), targets[i]
-                    )->start();
-                }
-            }));
+        // sse 的頁面送完就關，輸出走另一條 mode=events 連線
+        if(mode == "sse") {
+            send_response(oss.str());
+            return;
+        }
+
+        // skeleton 排進 outbox，**不**關 socket；之後的 script 會排在它後面
+        enqueue(oss.str());
+        start_remotes(targets);
+    }
+
+    void start_remotes(const std::vector<Target>& targets) {
+        remotes_ = targets.size();
+        sse_pending_.assign(targets.size(), std::string());
+        sse_kind_.assign(targets.size(), '\0');
+        if(remotes_ == 0 && sse_) enqueue("event: end\ndata:\n\n");
+        for(size_t i=0; i<targets.size(); ++i) {
+            std::make_shared<RemoteSession>(
+                strand_, int(i), shared_from_this(), targets[i]
+            )->start();
+        }
     }
 
     // 真正要結束連線時呼叫：送完整 HTTP + 關 socket
-    void send_response(const std::string& s) {
+    void send_response(std::string s) {
         auto self = shared_from_this();
+        auto out = std::make_shared<std::string>(std::move(s));
         boost::asio::async_write(socket_,
-            boost::asio::buffer(s),
+            boost::asio::buffer(*out),
             boost::asio::bind_executor(strand_,
-            [self](auto,auto){
+            [self,out](auto,auto){
                 self->socket_.close();
             }));
     }
@@ -274,49 +634,120 @@ void handle_panel() {
     // 負責單一遠端連線，並注入 <script> 回 Browser
     class RemoteSession : public std::enable_shared_from_this<RemoteSession> {
     public:
-        RemoteSession(boost::asio::io_context& io, int id,
+        // resolver / socket 都建在 parent 的 strand 上，handler 不會跟 HttpSession 同時跑
+        RemoteSession(const strand_type& strand, int id,
                       HttpSessionPtr parent, const Target& tgt)
-          : resolver_(io), socket_(io),
+          : resolver_(strand), socket_(strand), deadline_(strand),
             id_(id), parent_(parent),
-            host_(tgt.host), port_(tgt.port),
-            cmdfile_("test_case/"+tgt.file)
+            host_(tgt.host), port_(tgt.port), key_(host_ + ":" + port_),
+            cmdfile_(script_cache::instance().open("test_case/"+tgt.file))
         {}
+        ~RemoteSession() { parent_->remote_done(); }
         void start() {
             if(!cmdfile_) return;
-            auto self = shared_from_this();
-            resolver_.async_resolve(host_, port_,
-            [this,self](auto ec, auto eps){
-                if(ec) return;
-                boost::asio::async_connect(socket_, eps,
-                [this,self](auto ec2, auto){
-                    if(!ec2) do_read();
-                });
-            });
+            if(host_health.is_down(key_)) {
+                send_to_client("*** " + key_ + " is marked down, skipped ***\n", false);
+                return;
+            }
+            connect();
         }
     private:
         tcp::resolver        resolver_;
         tcp::socket          socket_;
+        boost::asio::steady_timer deadline_;
         int                  id_;
         HttpSessionPtr       parent_;
-        std::string          host_, port_;
-        std::ifstream        cmdfile_;
+        std::string          host_, port_, key_;
+        script_cursor        cmdfile_;
         std::string          next_;
         std::array<char,4096> buf_;
+        int                  attempts_ = 0;
+        const char*          timed_out_ = nullptr;   // timer 取消操作時的原因
+        std::chrono::steady_clock::time_point last_prompt_;
+
+        // resolve / connect 各有 timeout，失敗就等一下重試，最多 health::max_attempts 次
+        void connect() {
+            auto self = shared_from_this();
+            arm(health::resolve_timeout, "resolve timeout");
+            resolver_.async_resolve(host_, port_,
+            [this,self](auto ec, auto eps){
+                if(ec) { retry(ec); return; }
+                arm(health::connect_timeout, "connect timeout");
+                boost::asio::async_connect(socket_, eps,
+                [this,self](auto ec2, auto){
+                    if(ec2) { retry(ec2); return; }
+                    host_health.success(key_);
+                    last_prompt_ = std::chrono::steady_clock::now();
+                    do_read();
+                });
+            });
+        }
+
+        void retry(const boost::system::error_code& ec) {
+            deadline_.cancel();
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            std::string why = timed_out_ ? timed_out_ : ec.message();
+            timed_out_ = nullptr;
+            if(++attempts_ < health::max_attempts) {
+                auto self = shared_from_this();
+                deadline_.expires_after(health::backoff(attempts_ - 1));
+                deadline_.async_wait([this,self](boost::system::error_code e){
+                    if(!e) connect();
+                });
+                return;
+            }
+            host_health.failure(key_);
+            send_to_client("*** " + key_ + ": " + why + " ***\n", false);
+        }
+
+        // 到期就把進行中的操作取消，handler 會收到錯誤
+        void arm(std::chrono::steady_clock::duration after, const char* what) {
+            deadline_.expires_after(after);
+            auto self = shared_from_this();
+            deadline_.async_wait([this,self,what](boost::system::error_code ec){
+                // 重設 timer 時舊的 wait 可能已經排進佇列，確認真的到期了
+                if(ec || deadline_.expiry() > std::chrono::steady_clock::now()) return;
+                timed_out_ = what;
+                resolver_.cancel();
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+            });
+        }
 
         void do_read() {
             auto self = shared_from_this();
+            if(parent_->congested()) {
+                // 等 browser 的時間不算 idle
+                deadline_.cancel();
+                parent_->when_writable([this,self]{ do_read(); });
+                return;
+            }
+            // idle 沒資料，或太久沒看到 prompt，先到的那個
+            auto now = std::chrono::steady_clock::now();
+            if(last_prompt_ + health::prompt_timeout < now + health::idle_timeout)
+                arm(last_prompt_ + health::prompt_timeout - now, "no prompt");
+            else
+                arm(health::idle_timeout, "idle timeout");
             socket_.async_read_some(boost::asio::buffer(buf_),
             [this,self](auto ec, std::size_t n){
-                if(ec) return;
+                if(ec) {
+                    deadline_.cancel();
+                    if(timed_out_)
+                        send_to_client(std::string("\n*** ") + timed_out_ + " ***\n", false);
+                    return;
+                }
                 std::string data(buf_.data(), n);
                 send_to_client(data, false);
-                if(data.find("% ") != std::string::npos)
+                if(data.find("% ") != std::string::npos) {
+                    last_prompt_ = std::chrono::steady_clock::now();
                     send_next();
+                }
                 do_read();
             });
         }
         void send_next() {
-            if(!std::getline(cmdfile_, next_)) return;
+            if(!cmdfile_.getline(next_)) return;
             next_ += "\n";
             send_to_client(next_, true);
             auto self = shared_from_this();
@@ -324,42 +755,50 @@ void handle_panel() {
                 boost::asio::buffer(next_),
                 [this,self](auto,auto){});
         }
+        // escape 直接寫進要送出的 script；SSE 交給 parent 累積成 frame（都在同一個 strand 上）
         void send_to_client(const std::string& txt, bool is_cmd) {
-            std::string esc = html_escape(txt);
-            std::ostringstream js;
-            js << "<script>document.getElementById('s"
-               << id_ << "').innerHTML += '";
-            if(is_cmd) js << "<b>";
-            js << esc;
-            if(is_cmd) js << "</b>";
-            js << "';</script>\n";
-            parent_->deliver(js.str());
+            if(parent_->sse()) {
+                parent_->sse_append(id_, is_cmd ? 'c' : 'o', txt);
+                return;
+            }
+            std::string js = "<script>document.getElementById('s"
+                           + std::to_string(id_) + "').innerHTML += '";
+            if(is_cmd) js += "<b>";
+            html_escape_append(js, txt);
+            if(is_cmd) js += "</b>";
+            js += "';</script>\n";
+            parent_->deliver(std::move(js));
         }
     }; // end RemoteSession
 
 }; // end HttpSession
 
 int main(int argc, char* argv[]){
-    if(argc != 2){
-        std::cerr << "Usage: cgi_server.exe <port>\n";
+    if(argc != 2 && argc != 3){
+        std::cerr << "Usage: cgi_server.exe <port> [threads]\n";
         return 1;
     }
+    // 預設單一 thread，跟以前一樣
+    int threads = argc == 3 ? std::max(1, std::atoi(argv[2])) : 1;
     try {
-        boost::asio::io_context io;
+        boost::asio::io_context io(threads);
         tcp::acceptor acceptor(io,tcp::endpoint(tcp::v4(), std::atoi(argv[1])));
         std::function<void()> do_accept;
         do_accept = [&](){
             acceptor.async_accept(
             [&](boost::system::error_code ec, tcp::socket sock){
                 if(!ec)
-                    std::make_shared<HttpSession>(
-                        std::move(sock), io
-                    )->start();
+                    std::make_shared<HttpSession>(std::move(sock))->start();
                 do_accept();
             });
         };
         do_accept();
+
+        std::vector<std::thread> pool;
+        for(int i = 1; i < threads; ++i)
+            pool.emplace_back([&io]{ io.run(); });
         io.run();
+        for(auto& t : pool) t.join();
     }
     catch(std::exception& e){
         std::cerr << "Exception: " << e.what() << "\n";
@@ -1,7 +1,11 @@
 #include <boost/asio.hpp>
+#include <chrono>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iomanip>
 #include <map>
@@ -10,134 +14,422 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "escape.h"
+#include "health.h"
+#include "script_cache.h"
 
 using boost::asio::ip::tcp;
 
-std::string html_escape(const std::string& src) {
-    std::string out;
-    out.reserve(src.size()*2);
-    for (char c : src) {
-        switch (c) {
-            case '&':  out += "&amp;";  break;
-            case '<':  out += "&lt;";   break;
-            case '>':  out += "&gt;";   break;
-            case '"':  out += "&quot;"; break;
-            case '\'': out += "&#39;";  break;
-            case '\n': out += "&NewLine;"; break;
-            case '\r': break;
-            default:   out += c;
+constexpr auto flush_interval = std::chrono::milliseconds(50); // 最多累積多久才送出
+constexpr size_t flush_bytes  = 64 * 1024;                     // 或累積到這麼多就馬上送
+constexpr size_t session_budget = 16 * 1024; // 單一 session 累積這麼多也馬上送，不讓它佔住 buffer
+constexpr size_t max_sessions   = 1000; // QUERY_STRING 裡最多接受幾組 h/p/f
+constexpr size_t connect_window = 16;   // 同時 resolve/connect 的 session 上限
+constexpr size_t page_columns   = 5;    // 每頁顯示幾個 session
+constexpr size_t max_pipeline   = 64;   // pl= 最多允許領先幾行
+
+// ---------- Output ----------
+// 各 session 的輸出先累積，每 flush_interval 或累積到 flush_bytes 時，
+// 把所有 session 合成一次 writev 寫到 stdout：
+//   html: 一個 <script>，a(i, html) 用 insertAdjacentHTML 附加，不會整段 innerHTML 重新 parse
+//   sse : 一個 event，data 是 [{"s":i,"k":"o"|"c","d":"..."},...]，同 session 連續同種的合成一個 frame
+class Output {
+public:
+    Output(boost::asio::io_context& io, size_t sessions, bool sse)
+        : timer_(io), sse_(sse), pending_(sessions), prefix_(sessions), kind_(sessions) {
+        for (size_t i = 0; i < sessions; ++i)
+            prefix_[i] = sse ? "{\"s\":" + std::to_string(i) + ",\"k\":\""
+                             : "a(" + std::to_string(i) + ",'";
+    }
+
+    // Insert the server response into the corresponding <pre id='sX'>
+    void shell(int id, const std::string& msg) { append(id, 'o', msg); }
+
+    // Add the client command in bold and insert
+    void cmd(int id, const std::string& cmd) { append(id, 'c', cmd); }
+
+    void flush() {
+        if (buffered_ == 0) return;
+        timer_.cancel();
+        armed_ = false;
+
+        static const char open[] = "<script>", close[] = "</script>\n";
+        static const char sse_open[] = "data: [", sse_close[] = "]\n\n";
+        std::vector<iovec> iov;
+        if (sse_) iov.push_back({const_cast<char*>(sse_open), sizeof(sse_open) - 1});
+        else      iov.push_back({const_cast<char*>(open), sizeof(open) - 1});
+        bool first = true;
+        for (size_t i = 0; i < pending_.size(); ++i) {
+            if (pending_[i].empty()) continue;
+            if (sse_) {
+                if (!first) iov.push_back({const_cast<char*>(","), 1});
+                iov.push_back({&pending_[i][0], pending_[i].size()});
+                iov.push_back({const_cast<char*>("\"}"), 2});
+            } else {
+                iov.push_back({&prefix_[i][0], prefix_[i].size()});
+                iov.push_back({&pending_[i][0], pending_[i].size()});
+                iov.push_back({const_cast<char*>("');"), 3});
+            }
+            first = false;
+            ++dom_ops_;
         }
+        if (sse_) iov.push_back({const_cast<char*>(sse_close), sizeof(sse_close) - 1});
+        else      iov.push_back({const_cast<char*>(close), sizeof(close) - 1});
+        write_all(iov);
+
+        bytes_ += buffered_;
+        ++flushes_;
+        for (auto& p : pending_) p.clear();
+        std::fill(kind_.begin(), kind_.end(), '\0');
+        buffered_ = 0;
     }
-    return out;
-}
 
-void output_shell(int id, const std::string& msg) {
-    std::cout << "<script>document.getElementById('s" << id
-              << "').innerHTML += '" << html_escape(msg)
-              << "';</script>\n" << std::flush;
-}
+    // 全部 session 結束：送出剩下的；sse 另外送 end event，不然 EventSource 會自己重連
+    void finish() {
+        flush();
+        if (sse_) {
+            static const char end[] = "event: end\ndata:\n\n";
+            std::vector<iovec> iov{{const_cast<char*>(end), sizeof(end) - 1}};
+            write_all(iov);
+        }
+    }
 
-void output_cmd(int id, const std::string& cmd) {
-    std::cout << "<script>document.getElementById('s" << id
-              << "').innerHTML += '<b>"
-              << html_escape(cmd)
-              << "</b>';</script>\n" << std::flush;
-}
+    // CONSOLE_STATS: 結束時把輸出量與 DOM 操作次數印到 stderr
+    void report(std::chrono::steady_clock::duration elapsed) const {
+        double sec = std::chrono::duration<double>(elapsed).count();
+        std::cerr << "console: " << bytes_ << " bytes in " << flushes_
+                  << " flushes, " << dom_ops_ << " DOM inserts, "
+                  << (sec > 0 ? bytes_ / sec : 0) << " bytes/s\n";
+    }
+
+private:
+    // escape 直接寫進 pending_；sse 的最後一個 frame 保持開著，同種的內容可以接在後面
+    void append(int id, char kind, const std::string& msg) {
+        std::string& p = pending_[id];
+        if (sse_) {
+            if (kind_[id] != kind) {
+                if (kind_[id]) p += "\"},";
+                p += prefix_[id];
+                p += kind;
+                p += "\",\"d\":\"";
+                kind_[id] = kind;
+            }
+            json_escape_append(p, msg);
+        } else {
+            if (kind == 'c') p += "<b>";
+            html_escape_append(p, msg);
+            if (kind == 'c') p += "</b>";
+        }
+        appended(id, msg.size());
+    }
+
+    // 這裡只負責決定何時送出
+    void appended(int id, size_t n) {
+        buffered_ += n;
+        if (buffered_ >= flush_bytes || pending_[id].size() >= session_budget) {
+            flush();
+        } else if (!armed_) {
+            armed_ = true;
+            timer_.expires_after(flush_interval);
+            timer_.async_wait([this](boost::system::error_code ec) {
+                if (!ec) flush();
+            });
+        }
+    }
+
+    // writev 可能只寫一部分，一次也最多 IOV_MAX 個
+    static void write_all(std::vector<iovec>& iov) {
+        size_t first = 0;
+        while (first < iov.size()) {
+            int cnt = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+            ssize_t n = ::writev(STDOUT_FILENO, &iov[first], cnt);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            while (first < iov.size() && static_cast<size_t>(n) >= iov[first].iov_len) {
+                n -= iov[first].iov_len;
+                ++first;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+                iov[first].iov_len -= n;
+            }
+        }
+    }
+
+    boost::asio::steady_timer timer_;
+    bool armed_ = false;
+    bool sse_;
+    std::vector<std::string> pending_, prefix_;
+    std::vector<char> kind_;    // sse: 各 session 目前開著的 frame 種類，0 表示沒有
+    size_t buffered_ = 0;
+    unsigned long long bytes_ = 0, flushes_ = 0, dom_ops_ = 0;
+};
+
+// ---------- ConnectWindow ----------
+// 上百個 session 時不要一次全部 resolve/connect，超過上限的排隊
+class ConnectWindow {
+public:
+    explicit ConnectWindow(size_t limit) : limit_(limit) {}
+
+    void acquire(std::function<void()> start) {
+        if (active_ < limit_) {
+            ++active_;
+            start();
+        } else {
+            waiting_.push_back(std::move(start));
+        }
+    }
+
+    // connect 成功或失敗都要呼叫，把名額交給下一個
+    void release() {
+        if (waiting_.empty()) {
+            --active_;
+            return;
+        }
+        auto next = std::move(waiting_.front());
+        waiting_.pop_front();
+        next();
+    }
+
+private:
+    size_t limit_, active_ = 0;
+    std::deque<std::function<void()>> waiting_;
+};
 
 // ---------- Session ----------
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    Session(boost::asio::io_context& io, int id,
-            std::string host, std::string port, std::string file)
-        : resolver_(io), socket_(io),
-          id_(id), host_(std::move(host)), port_(std::move(port)),
-          file_(std::move(file)) {}
+    // pipeline: 最多同時送出幾行還沒看到對應 prompt 的指令，1 就是一問一答
+    Session(boost::asio::io_context& io, Output& out, ConnectWindow& window,
+            health_table& health, int id, std::string host, std::string port,
+            std::string file, size_t pipeline)
+        : resolver_(io), socket_(io), deadline_(io), out_(out), window_(window),
+          health_(health), id_(id), host_(std::move(host)), port_(std::move(port)),
+          file_(std::move(file)), key_(host_ + ":" + port_), pipeline_(pipeline) {}
 
     void start() {
-        cmdfile_.open("test_case/" + file_);
+        cmdfile_ = script_cache::instance().open("test_case/" + file_);
         if (!cmdfile_) return;
+        // 最近確定連不上的就不浪費 timeout 了
+        if (health_.is_down(key_)) {
+            out_.shell(id_, "*** " + key_ + " is marked down, skipped ***\n");
+            return;
+        }
+        auto self = shared_from_this();
+        window_.acquire([this, self] { connect(); });
+    }
+
+private:
+    // resolve / connect 各有 timeout，失敗就等一下重試，最多 health::max_attempts 次
+    void connect() {
         auto self = shared_from_this();
+        arm(health::resolve_timeout, "resolve timeout");
         resolver_.async_resolve(host_, port_,
             [this, self](auto ec, auto results){
-                if(!ec){
-                    boost::asio::async_connect(socket_, results,
-                    [this, self](auto ec2, auto){
-                        if( !ec2) do_read();
-                    });
-                }
+                if(ec) { retry(ec); return; }
+                arm(health::connect_timeout, "connect timeout");
+                boost::asio::async_connect(socket_, results,
+                [this, self](auto ec2, auto){
+                    if(ec2) { retry(ec2); return; }
+                    window_.release();
+                    health_.success(key_);
+                    last_prompt_ = std::chrono::steady_clock::now();
+                    do_read();
+                });
             });
     }
 
-private:
+    void retry(const boost::system::error_code& ec) {
+        deadline_.cancel();
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        std::string why = timed_out_ ? timed_out_ : ec.message();
+        timed_out_ = nullptr;
+        if (++attempts_ < health::max_attempts) {
+            auto self = shared_from_this();
+            deadline_.expires_after(health::backoff(attempts_ - 1));
+            deadline_.async_wait([this, self](boost::system::error_code e) {
+                if (!e) connect();
+            });
+            return;
+        }
+        window_.release();
+        health_.failure(key_);
+        out_.shell(id_, "*** " + key_ + ": " + why + " ***\n");
+    }
+
+    // 到期就把進行中的操作取消，handler 會收到錯誤；what 是要顯示的原因
+    void arm(std::chrono::steady_clock::duration after, const char* what) {
+        deadline_.expires_after(after);
+        auto self = shared_from_this();
+        deadline_.async_wait([this, self, what](boost::system::error_code ec) {
+            // 重設 timer 時舊的 wait 可能已經排進佇列，確認真的到期了
+            if (ec || deadline_.expiry() > std::chrono::steady_clock::now()) return;
+            timed_out_ = what;
+            resolver_.cancel();
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+        });
+    }
+
+    // 每次讀之前重設：idle 沒資料，或太久沒看到 prompt，先到的那個
+    void arm_read_deadline() {
+        auto now = std::chrono::steady_clock::now();
+        auto idle = now + health::idle_timeout;
+        auto prompt = last_prompt_ + health::prompt_timeout;
+        if (prompt < idle)
+            arm(prompt - now, "no prompt");
+        else
+            arm(health::idle_timeout, "idle timeout");
+    }
+
     void do_read() {
         auto self = shared_from_this();
+        arm_read_deadline();
         socket_.async_read_some(boost::asio::buffer(buf_),
             [this, self](auto ec, std::size_t n) {
                 if (!ec) {
                     std::string data(buf_.data(), n);
-                    output_shell(id_, data); //output to web
-                    if(data.find("% ") != std::string::npos)
-                        send_next();
+                    out_.shell(id_, data); //output to web
+                    size_t prompts = count_prompts(data);
+                    if (prompts) last_prompt_ = std::chrono::steady_clock::now();
+                    for (; prompts > 0; --prompts)
+                        on_prompt();
                     do_read();
+                    return;
                 }
+                // 結束時 timer 也要停，不然 io.run() 會等到它到期
+                deadline_.cancel();
+                if (timed_out_)
+                    out_.shell(id_, std::string("\n*** ") + timed_out_ + " ***\n");
             });
     }
 
-    void send_next() {
-        if (!std::getline(cmdfile_, next_)) return;
-        next_ += "\n";
-        output_cmd(id_, next_); //output to web
+    // "% " 可能被切在兩次 read 之間，saw_percent_ 記住上一塊最後是不是 '%'
+    size_t count_prompts(const std::string& data) {
+        size_t prompts = 0;
+        for (char c : data) {
+            if (saw_percent_ && c == ' ') ++prompts;
+            saw_percent_ = (c == '%');
+        }
+        return prompts;
+    }
+
+    // 每個 prompt 對應檔案裡的下一行：已經先送出去的就只顯示，否則現在送；
+    // 然後補送到領先 pipeline_-1 行
+    void on_prompt() {
+        std::string line;
+        if (!ahead_.empty()) {
+            line = std::move(ahead_.front());
+            ahead_.pop_front();
+        } else if (next_line(line)) {
+            send_line(line);
+        } else {
+            return;
+        }
+        out_.cmd(id_, line); //output to web
+
+        while (ahead_.size() + 1 < pipeline_ && next_line(line)) {
+            send_line(line);
+            ahead_.push_back(line);
+        }
+    }
+
+    bool next_line(std::string& line) {
+        if (!cmdfile_.getline(line)) return false;
+        line += "\n";
+        return true;
+    }
+
+    // 同一時間只有一個 async_write，排隊的行在上一個寫完後一起送
+    void send_line(const std::string& line) {
+        queued_ += line;
+        if (!writing_.empty()) return;
+        flush_queue();
+    }
+
+    void flush_queue() {
+        writing_.swap(queued_);
         auto self = shared_from_this();
         boost::asio::async_write(socket_, //output to RWG
-            boost::asio::buffer(next_),
-            [this, self](auto, std::size_t) {});
+            boost::asio::buffer(writing_),
+            [this, self](auto ec, std::size_t) {
+                writing_.clear();
+                if (!ec && !queued_.empty()) flush_queue();
+            });
     }
 
     tcp::resolver resolver_;
     tcp::socket   socket_;
+    boost::asio::steady_timer deadline_;
+    Output&       out_;
+    ConnectWindow& window_;
+    health_table& health_;
     std::array<char, 4096> buf_;
     int id_;
-    std::string host_, port_, file_;
-    std::ifstream cmdfile_;
-    std::string next_;
+    std::string host_, port_, file_, key_;
+    int attempts_ = 0;
+    const char* timed_out_ = nullptr;  // timer 取消操作時的原因
+    std::chrono::steady_clock::time_point last_prompt_;
+    script_cursor cmdfile_;
+    size_t pipeline_;
+    bool saw_percent_ = false;
+    std::deque<std::string> ahead_;    // 已送出、還沒輪到 prompt 的行
+    std::string queued_, writing_;     // 等著寫 / 正在寫給 RWG 的資料
 };
 
-//QUERY_STRING
+//QUERY_STRING, h0..hN / p0..pN / f0..fN，index 可以是多位數；pl=K 開啟 pipeline
+//mode=sse: 只回頁面，頁面再用 EventSource 連 mode=events 拿輸出
 struct Target { std::string h,p,f; };
-std::vector<Target> parse_query() {
+struct QueryData {
+    std::vector<Target> targets;
+    size_t pipeline = 1;
+    std::string mode;
+};
+QueryData parse_query() {
+    QueryData q;
     const char* qs = std::getenv("QUERY_STRING");
-    std::vector<Target> res(5);
-    if (!qs) return {};
-    //kv_re = key-value regular expression
-    std::regex kv_re(R"(([hpf])(\d)=(.*?)(&|$))");
-    std::cmatch m;
-    const char* cur = qs;
-    while( std::regex_search(cur, m, kv_re)){
-        char ch = m[1].str()[0];
-        int idx = m[2].str()[0] - '0';
-        std::string val = m[3];
-        if( idx>=0 && idx<5 ){
-            if(ch =='h') res[idx].h = val;
-            else if (ch == 'p') res[idx].p = val;
-            else if(ch == 'f') res[idx].f = val;
+    if (!qs) return q;
+    std::map<int, Target> res; // 依 index 排序
+    std::istringstream ss(qs);
+    std::string token;
+    while (std::getline(ss, token, '&')) {
+        auto eq = token.find('=');
+        if (token.compare(0, 3, "pl=") == 0) {
+            size_t k = std::strtoul(token.c_str() + 3, nullptr, 10);
+            q.pipeline = std::max<size_t>(1, std::min(k, max_pipeline));
+            continue;
+        }
+        if (token.compare(0, 5, "mode=") == 0) {
+            q.mode = token.substr(5);
+            continue;
         }
-        cur = m.suffix().first;
+        if (eq < 2 || eq == std::string::npos) continue;
+        char ch = token[0];
+        if (ch != 'h' && ch != 'p' && ch != 'f') continue;
+        std::string digits = token.substr(1, eq - 1);
+        if (digits.size() > 4 || digits.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+        int idx = std::stoi(digits);
+        std::string val = token.substr(eq + 1);
+        if(ch =='h') res[idx].h = val;
+        else if (ch == 'p') res[idx].p = val;
+        else res[idx].f = val;
     }
-    std::vector<Target> out;
-    for(auto& t: res)
-        if(!t.h.empty() && !t.p.empty() && !t.f.empty())
-            out.push_back(t);
-    return out;
+    for(auto& kv: res)
+        if(!kv.second.h.empty() && !kv.second.p.empty() && !kv.second.f.empty() &&
+           q.targets.size() < max_sessions)
+            q.targets.push_back(kv.second);
+    return q;
 }
 
-int main() {
-    //HTTP header
-    std::cout << "Content-Type: text/html\r\n\r\n";
-
-    //link info
-    auto targets = parse_query();
-
-    //generate table frame
+//generate table frame；mode=sse 時頁面多一段 EventSource 的 script
+void print_page(const QueryData& query) {
+    auto& targets = query.targets;
     std::cout << R"(
     <!DOCTYPE html><html>
     <head><meta charset="UTF-8">
@@ -149,22 +441,84 @@ int main() {
       b { color:#01b468; }
       pre   { margin:0; white-space:pre-wrap; color:#f1f3f5; } 
       </style>
+      <script>function a(i,h){document.getElementById('s'+i).insertAdjacentHTML('beforeend',h);}
+      function pg(n){var t=document.getElementsByClassName('pg');
+        for(var i=0;i<t.length;++i)t[i].style.display=(i==n?'':'none');}</script>
     </head>
-    <body><table class="table table-dark table-bordered"><thead><tr>)";
+    <body>)";
+    if (query.mode == "sse")
+        std::cout << R"(<script>
+      var es=new EventSource(location.search.replace('mode=sse','mode=events'));
+      es.onmessage=function(e){var f=JSON.parse(e.data);
+        for(var j=0;j<f.length;++j){var p=document.getElementById('s'+f[j].s),n;
+          if(f[j].k=='c'){n=document.createElement('b');n.textContent=f[j].d;}
+          else n=document.createTextNode(f[j].d);
+          p.appendChild(n);}};
+      es.addEventListener('end',function(){es.close();});
+      </script>)";
 
-    for (auto& t:targets)
-        std::cout << "<th>" << t.h << ":" << t.p << "</th>";
-    std::cout << "</tr></thead><tbody><tr>";
-    for (size_t i=0;i<targets.size();++i)
-        std::cout << "<td><pre id=\"s" << i << "\"></pre></td>";
-    std::cout << "</tr></tbody></table>\n" << std::flush;
+    // 每 page_columns 個 session 一頁；不在畫面上的頁 display:none，附加內容時不用重新排版
+    size_t pages = (targets.size() + page_columns - 1) / page_columns;
+    if (pages > 1) {
+        std::cout << "<div class=\"p-2\">";
+        for (size_t p = 0; p < pages; ++p)
+            std::cout << "<button class=\"btn btn-sm btn-secondary m-1\" onclick=\"pg(" << p
+                      << ")\">" << p * page_columns + 1 << "-"
+                      << std::min(targets.size(), (p + 1) * page_columns) << "</button>";
+        std::cout << "</div>";
+    }
+    for (size_t p = 0; p < pages; ++p) {
+        size_t first = p * page_columns;
+        size_t last = std::min(targets.size(), first + page_columns);
+        std::cout << "<table class=\"table table-dark table-bordered pg\""
+                  << (p ? " style=\"display:none\"" : "") << "><thead><tr>";
+        for (size_t i = first; i < last; ++i)
+            std::cout << "<th>" << html_escape(targets[i].h) << ":"
+                      << html_escape(targets[i].p) << "</th>";
+        std::cout << "</tr></thead><tbody><tr>";
+        for (size_t i = first; i < last; ++i)
+            std::cout << "<td><pre id=\"s" << i << "\"></pre></td>";
+        std::cout << "</tr></tbody></table>\n";
+    }
+    std::cout << std::flush;
+}
+
+int main() {
+    //link info
+    auto query = parse_query();
+    auto& targets = query.targets;
+    bool events = query.mode == "events";
+
+    //HTTP header
+    if (events)
+        std::cout << "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n"
+                  << std::flush;    // 之後 Output 直接 writev，不經過 cout
+    else
+        std::cout << "Content-Type: text/html\r\n\r\n";
+
+    if (!events) {
+        print_page(query);
+        if (query.mode == "sse") return 0;  // 輸出由 mode=events 那條連線負責
+    }
 
+    auto begin = std::chrono::steady_clock::now();
     boost::asio::io_context io;
+    Output out(io, targets.size(), events);
+    ConnectWindow window(connect_window);
+    // 每次 CGI 都是新的 process，連不上的 host 記在檔案裡給下一次用
+    const char* health_env = std::getenv("CONSOLE_HEALTH");
+    std::string health_path = health_env ? health_env : health::default_path();
+    health_table health;
+    health.load(health_path);
     for (size_t i=0; i<targets.size(); ++i) {
         auto& t = targets[i];
-        std::make_shared<Session>(io, static_cast<int>(i),
-                                  t.h, t.p, t.f)->start();
+        std::make_shared<Session>(io, out, window, health, static_cast<int>(i),
+                                  t.h, t.p, t.f, query.pipeline)->start();
     }
     io.run();
+    health.save(health_path);
+    out.finish();
+    if (std::getenv("CONSOLE_STATS"))
+        out.report(std::chrono::steady_clock::now() - begin);
     return 0;
 }
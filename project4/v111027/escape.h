@@ -0,0 +1,157 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+// console.cgi、cgi_server 共用的 escape（project5 的 pj5.cgi 有一份一樣的）。
+// 結果會放進 innerHTML，也會包在 JS 的單引號字串裡，所以除了 HTML 特殊字元，
+// 引號、反斜線、換行也要處理。沒有特殊字元的區段用 SSE2/AVX2 一次掃 16/32 bytes 整段複製。
+// SSE 模式的 frame 是 JSON，另外有 json_escape_append。
+
+#include <cstddef>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ESCAPE_HAVE_X86 1
+#endif
+
+namespace escape_detail {
+
+inline bool is_special(char c) {
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'' ||
+           c == '\\' || c == '\r' || c == '\n';
+}
+
+inline void append_replacement(std::string& out, char c) {
+    switch (c) {
+        case '&':  out.append("&amp;", 5);      break;
+        case '<':  out.append("&lt;", 4);       break;
+        case '>':  out.append("&gt;", 4);       break;
+        case '"':  out.append("&quot;", 6);     break;
+        case '\'': out.append("&#39;", 5);      break;
+        case '\\': out.append("&#92;", 5);      break;
+        case '\n': out.append("&NewLine;", 9);  break;
+        case '\r': break;
+        default:   out += c;
+    }
+}
+
+// 回傳第一個特殊字元的位置，沒有就回傳 n
+inline size_t scan_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && !is_special(p[i])) ++i;
+    return i;
+}
+
+#if defined(ESCAPE_HAVE_X86) && defined(__SSE2__)
+inline size_t scan_sse2(const char* p, size_t n) {
+    const __m128i amp = _mm_set1_epi8('&'),  lt = _mm_set1_epi8('<'),
+                  gt  = _mm_set1_epi8('>'),  dq = _mm_set1_epi8('"'),
+                  sq  = _mm_set1_epi8('\''), bs = _mm_set1_epi8('\\'),
+                  cr  = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, lt)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, gt),  _mm_cmpeq_epi8(v, dq))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sq),  _mm_cmpeq_epi8(v, bs)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, cr),  _mm_cmpeq_epi8(v, lf))));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(p + i, n - i);
+}
+#endif
+
+#if defined(ESCAPE_HAVE_X86)
+__attribute__((target("avx2")))
+inline size_t scan_avx2(const char* p, size_t n) {
+    const __m256i amp = _mm256_set1_epi8('&'),  lt = _mm256_set1_epi8('<'),
+                  gt  = _mm256_set1_epi8('>'),  dq = _mm256_set1_epi8('"'),
+                  sq  = _mm256_set1_epi8('\''), bs = _mm256_set1_epi8('\\'),
+                  cr  = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, amp), _mm256_cmpeq_epi8(v, lt)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, gt),  _mm256_cmpeq_epi8(v, dq))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sq),  _mm256_cmpeq_epi8(v, bs)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),  _mm256_cmpeq_epi8(v, lf))));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(m));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(p + i, n - i);
+}
+#endif
+
+using scan_fn = size_t (*)(const char*, size_t);
+
+// 執行時挑 CPU 支援的最快版本，只做一次
+inline scan_fn pick_scan() {
+#if defined(ESCAPE_HAVE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scan_avx2;
+#endif
+#if defined(ESCAPE_HAVE_X86) && defined(__SSE2__)
+    return scan_sse2;
+#else
+    return scan_scalar;
+#endif
+}
+
+} // namespace escape_detail
+
+// 把 src 的 escape 結果直接接在 out 後面，不產生暫存字串
+inline void html_escape_append(std::string& out, const char* src, size_t n) {
+    static const escape_detail::scan_fn scan = escape_detail::pick_scan();
+    out.reserve(out.size() + n + n / 8);
+    size_t i = 0;
+    while (i < n) {
+        size_t run = scan(src + i, n - i);
+        out.append(src + i, run);
+        i += run;
+        if (i < n) escape_detail::append_replacement(out, src[i++]);
+    }
+}
+
+inline void html_escape_append(std::string& out, const std::string& src) {
+    html_escape_append(out, src.data(), src.size());
+}
+
+inline std::string html_escape(const std::string& src) {
+    std::string out;
+    html_escape_append(out, src);
+    return out;
+}
+
+// JSON 字串內容（不含前後引號），給 SSE 的 frame 用：只需處理 " \ 和控制字元
+inline void json_escape_append(std::string& out, const char* src, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    out.reserve(out.size() + n + n / 8);
+    size_t run = 0;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char c = static_cast<unsigned char>(src[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out.append(src + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"':  out.append("\\\"", 2); break;
+            case '\\': out.append("\\\\", 2); break;
+            case '\n': out.append("\\n", 2);  break;
+            case '\r': out.append("\\r", 2);  break;
+            case '\t': out.append("\\t", 2);  break;
+            default: {
+                char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                out.append(u, 6);
+            }
+        }
+    }
+    out.append(src + run, n - run);
+}
+
+inline void json_escape_append(std::string& out, const std::string& src) {
+    json_escape_append(out, src.data(), src.size());
+}
+
+#endif
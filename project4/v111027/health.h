@@ -0,0 +1,168 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+// console.cgi、cgi_server 共用：連遠端 shell 各階段的 timeout、重試間隔，
+// 以及記住哪些 host:port 最近連不上，下次直接跳過。
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace health {
+
+constexpr auto resolve_timeout = std::chrono::seconds(5);
+constexpr auto connect_timeout = std::chrono::seconds(5);
+constexpr auto idle_timeout    = std::chrono::seconds(30);   // 完全沒收到資料
+constexpr auto prompt_timeout  = std::chrono::seconds(120);  // 有資料但一直等不到 "% "
+constexpr int  max_attempts    = 3;                          // resolve + connect 最多試幾次
+
+constexpr time_t down_min = 30;        // 連不上之後跳過多久（秒），每多失敗一次加倍
+constexpr time_t down_max = 10 * 60;
+
+// 第 attempt 次重試前要等多久：250ms * 2^attempt，再隨機 ±50%，避免大家同時重試
+inline std::chrono::milliseconds backoff(int attempt) {
+    static thread_local std::mt19937 rng{std::random_device{}()};
+    long base = 250L << std::min(attempt, 6);
+    std::uniform_int_distribution<long> jitter(base / 2, base + base / 2);
+    return std::chrono::milliseconds(jitter(rng));
+}
+
+#ifndef _WIN32
+// console.cgi 預設的 health 檔：放在只有自己能進的 /tmp/np_console_<uid>/ 裡，
+// 別的使用者沒辦法先在裡面放 symlink。目錄不是自己的或權限不對就回傳 ""（不存）
+inline std::string default_path() {
+    std::string dir = "/tmp/np_console_" + std::to_string(getuid());
+    ::mkdir(dir.c_str(), 0700);
+    struct stat st;
+    if (::lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077)) return "";
+    return dir + "/health";
+}
+#endif
+
+} // namespace health
+
+// key 是 "host:port"。cgi_server 整個 process 共用一份；
+// console.cgi 每次都是新的 process，所以啟動時 load、結束時 save 到檔案
+class health_table {
+public:
+    // 還在冷卻時間內就回傳 true
+    bool is_down(const std::string& key) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        return it != entries_.end() && it->second.down_until > std::time(nullptr);
+    }
+
+    void success(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.erase(key);
+        dirty_.insert(key);
+    }
+
+    // 重試都用完了才呼叫
+    void failure(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entry& e = entries_[key];
+        ++e.failures;
+        time_t wait = std::min(cooldown(e.failures), health::down_max);
+        e.down_until = std::time(nullptr) + wait;
+        dirty_.insert(key);
+    }
+
+#ifndef _WIN32
+    // 檔案格式：每行 "host:port failures down_until"，讀不到就當作空的
+    void load(const std::string& path) {
+        if (path.empty()) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        read_file(path, entries_);
+    }
+
+    // 同時有好幾個 console.cgi 在跑：在 path.lock 上 flock，重讀檔案，
+    // 只把這次有碰過的 key 換成自己的結果，其他 key 保留別人寫的。
+    // 新內容寫到同目錄 mkstemp 開的檔案再 rename，讀的人不會看到寫一半的檔案，
+    // 也不會跟著別人預先放好的 symlink 寫到別的地方
+    void save(const std::string& path) const {
+        if (path.empty()) return;
+        int lock_fd = ::open((path + ".lock").c_str(),
+                             O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (lock_fd < 0) return;
+        if (::flock(lock_fd, LOCK_EX) < 0) { ::close(lock_fd); return; }
+
+        std::map<std::string, entry> merged;
+        read_file(path, merged);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& key : dirty_) {
+                auto it = entries_.find(key);
+                if (it == entries_.end()) merged.erase(key);
+                else                      merged[key] = it->second;
+            }
+        }
+
+        std::ostringstream out;
+        time_t now = std::time(nullptr);
+        for (auto& kv : merged) {
+            // 冷卻早就過了的不用留
+            if (kv.second.down_until + health::down_max < now) continue;
+            out << kv.first << ' ' << kv.second.failures << ' '
+                << kv.second.down_until << '\n';
+        }
+        std::string data = out.str();
+
+        std::string tmp = path + ".XXXXXX";
+        int fd = ::mkstemp(&tmp[0]);
+        if (fd >= 0) {
+            size_t done = 0;
+            while (done < data.size()) {
+                ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+                if (n <= 0) break;
+                done += n;
+            }
+            ::close(fd);
+            if (done == data.size()) std::rename(tmp.c_str(), path.c_str());
+            else                     ::unlink(tmp.c_str());
+        }
+        ::close(lock_fd);   // 順便放掉 flock
+    }
+#endif
+
+private:
+    struct entry {
+        int failures = 0;
+        time_t down_until = 0;
+    };
+
+#ifndef _WIN32
+    static void read_file(const std::string& path, std::map<std::string, entry>& into) {
+        std::ifstream in(path);
+        std::string key;
+        entry e;
+        while (in >> key >> e.failures >> e.down_until)
+            into[key] = e;
+    }
+#endif
+
+    static time_t cooldown(int failures) {
+        return health::down_min << std::min(failures - 1, 10);
+    }
+
+    mutable std::mutex mutex_;
+    std::map<std::string, entry> entries_;
+    std::set<std::string> dirty_;           // 這個 process 改過的 key，save 時只合併這些
+};
+
+#endif
@@ -8,33 +8,430 @@
 #include <string>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sstream>
 #include <cerrno>
+#include <chrono>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <vector>
 #include <boost/asio.hpp>
+#include "access_log.h"
 
 using boost::asio::ip::tcp;
 
 constexpr size_t max_length = 8192;          // 足夠放下完整 HTTP header
 constexpr char CRLF[]        = "\r\n";
 constexpr char HEADER_END[]  = "\r\n\r\n";
+constexpr size_t file_cache_entries = 64;   // LRU 最多保留幾個開啟的檔案
+constexpr auto file_cache_valid = std::chrono::seconds(1); // 多久重新 stat 一次
+constexpr size_t relay_buffer_size = 16384;  // relay mode 每塊 buffer 大小
+constexpr size_t relay_pool_max    = 64;     // buffer 池最多留幾塊
+constexpr size_t relay_window      = 2;      // 每個 session 最多同時佔用幾塊
+constexpr size_t cgi_header_max    = 8192;   // CGI 輸出的 header 上限
 
-void reap_child(int) {
-    while (waitpid(-1, nullptr, WNOHANG) > 0) {}
+constexpr auto header_timeout     = std::chrono::seconds(10); // 從第一個 byte 起，header 要在這之內讀完
+constexpr auto keep_alive_timeout = std::chrono::seconds(5);  // keep-alive 兩個 request 之間最多閒置多久
+constexpr auto cgi_start_timeout  = std::chrono::seconds(30); // relay mode: CGI 要在這之內輸出 header
+constexpr auto cgi_kill_grace     = std::chrono::seconds(2);  // 逾時的 CGI 收到 SIGTERM 後多久沒結束就 SIGKILL
+constexpr auto accept_retry_delay = std::chrono::milliseconds(100); // accept 失敗 (EMFILE...) 後的退避
+
+// 命令列選項
+struct server_options {
+    bool relay  = false; // CGI stdout 經 pipe 由 server 轉送 (chunked)，而不是直接 dup2 socket
+    bool splice = true;  // relay mode 下用 splice(2) 把 pipe 直接搬到 socket
+    size_t max_header_bytes = 8192; // request header 上限，超過回 431
+    size_t max_connections  = 1024; // 同時持有的連線上限，滿了就暫停 accept
+    size_t max_per_ip       = 32;   // 每個來源 IP 的連線上限，超過回 503
+    std::string doc_root    = "www";        // 靜態檔案的根目錄；跟放 CGI、原始碼的工作目錄分開
+    std::string access_log  = "access.log"; // 空字串表示不記錄
+    size_t access_log_max   = 16 << 20;     // 超過就 rotate 成 .1
+};
+server_options options;
+
+// 各種拒絕/逾時的次數，SIGUSR1 時印到 stderr
+struct reject_counters {
+    unsigned long long header_timeout = 0;
+    unsigned long long idle_timeout = 0;
+    unsigned long long cgi_timeout = 0;
+    unsigned long long header_too_large = 0;
+    unsigned long long per_ip_limit = 0;
+    unsigned long long accept_paused = 0;
+    unsigned long long accept_errors = 0;
+};
+reject_counters rejects;
+
+// 全域與每個 IP 的同時連線數；session 結束時歸還，必要時恢復 accept
+class connection_limiter {
+public:
+    bool full() const { return active_ >= options.max_connections; }
+
+    bool try_acquire(const boost::asio::ip::address& ip) {
+        size_t& n = per_ip_[ip];
+        if (n >= options.max_per_ip) {
+            if (n == 0) per_ip_.erase(ip);
+            return false;
+        }
+        ++n;
+        ++active_;
+        return true;
+    }
+
+    void release(const boost::asio::ip::address& ip) {
+        auto it = per_ip_.find(ip);
+        if (it != per_ip_.end() && --it->second == 0) per_ip_.erase(it);
+        --active_;
+        if (on_available && !full()) {
+            auto resume = std::move(on_available);
+            on_available = nullptr;
+            resume();
+        }
+    }
+
+    size_t active() const { return active_; }
+
+    std::function<void()> on_available; // accept 暫停中時由 server 設定
+
+private:
+    size_t active_ = 0;
+    std::map<boost::asio::ip::address, size_t> per_ip_;
+};
+
+// ---------- static file cache ----------
+
+// 解開 symlink 之後的絕對路徑；檔案還不存在時只解開目錄的部分
+std::string canonical_path(const std::string& path) {
+    if (char* p = ::realpath(path.c_str(), nullptr)) {
+        std::string out = p;
+        ::free(p);
+        return out;
+    }
+    auto slash = path.rfind('/');
+    std::string dir  = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    char* p = ::realpath(dir.c_str(), nullptr);
+    if (!p) return "";
+    std::string out = std::string(p) + "/" + base;
+    ::free(p);
+    return out;
+}
+
+// 不論 doc_root 設在哪都不能送出去的檔案（access log 和它 rotate 出來的 .1），main 裡設定
+std::vector<std::string> private_files;
+
+std::string http_date(time_t t) {
+    char buf[64];
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+bool parse_http_date(const std::string& s, time_t& out) {
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    if (!strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm)) return false;
+    out = timegm(&tm);
+    return true;
 }
 
+std::string content_type_for(const std::string& path) {
+    static const std::unordered_map<std::string, std::string> types = {
+        {"html", "text/html"},        {"htm", "text/html"},
+        {"css",  "text/css"},         {"js",  "application/javascript"},
+        {"json", "application/json"}, {"txt", "text/plain"},
+        {"png",  "image/png"},        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},       {"gif", "image/gif"},
+        {"svg",  "image/svg+xml"},    {"ico", "image/x-icon"},
+    };
+    auto dot = path.rfind('.');
+    if (dot != std::string::npos) {
+        auto it = types.find(path.substr(dot + 1));
+        if (it != types.end()) return it->second;
+    }
+    return "application/octet-stream";
+}
+
+// 一個已開啟的靜態檔案，header 在開檔時就先組好
+struct file_entry {
+    int fd = -1;
+    off_t size = 0;
+    time_t mtime = 0;
+    time_t ctime = 0;   // chmod 只改 ctime，不比的話變成執行檔之後還會被當靜態檔送出去
+    mode_t mode = 0;
+    ino_t ino = 0;
+    std::string etag, last_modified, content_type;
+    std::string header_keep_alive, header_close; // 完整的 200 response header
+    std::chrono::steady_clock::time_point checked;
+
+    ~file_entry() { if (fd >= 0) ::close(fd); }
+};
+
+// path -> 開啟中的 fd，LRU 淘汰；傳送中的 session 持有 shared_ptr，fd 在最後一個使用者放掉時才 close
+class file_cache {
+public:
+    explicit file_cache(size_t capacity) : capacity_(capacity) {}
+
+    // 檔案不存在或不是一般檔案時回傳 nullptr
+    std::shared_ptr<const file_entry> lookup(const std::string& path) {
+        auto now = std::chrono::steady_clock::now();
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            auto entry = it->second->second;
+            bool fresh = now - entry->checked < file_cache_valid;
+            struct stat st;
+            if (!fresh && ::stat(path.c_str(), &st) == 0 &&
+                st.st_ino == entry->ino && st.st_size == entry->size &&
+                st.st_mtime == entry->mtime && st.st_ctime == entry->ctime &&
+                st.st_mode == entry->mode) {
+                entry->checked = now;
+                fresh = true;
+            }
+            if (fresh) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return entry;
+            }
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        auto entry = open_entry(path);
+        if (!entry) return nullptr;
+        entry->checked = now;
+        lru_.emplace_front(path, entry);
+        index_[path] = lru_.begin();
+        while (lru_.size() > capacity_) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return entry;
+    }
+
+private:
+    static std::shared_ptr<file_entry> open_entry(const std::string& path) {
+        if (!private_files.empty()) {
+            std::string real = canonical_path(path);
+            for (auto& f : private_files)
+                if (real == f) return nullptr;
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        auto entry = std::make_shared<file_entry>();
+        entry->fd = fd;
+        struct stat st;
+        // 執行檔（CGI、編好的 server）不當作靜態檔案送出去
+        if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+            (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) return nullptr;
+        entry->size  = st.st_size;
+        entry->mtime = st.st_mtime;
+        entry->ctime = st.st_ctime;
+        entry->mode  = st.st_mode;
+        entry->ino   = st.st_ino;
+
+        std::ostringstream etag;
+        etag << '"' << std::hex << st.st_size << '-' << st.st_mtime << '"';
+        entry->etag = etag.str();
+        entry->last_modified = http_date(st.st_mtime);
+        entry->content_type  = content_type_for(path);
+
+        std::string common = "HTTP/1.1 200 OK\r\n"
+            "Content-Type: " + entry->content_type + "\r\n"
+            "Content-Length: " + std::to_string(st.st_size) + "\r\n"
+            "Last-Modified: " + entry->last_modified + "\r\n"
+            "ETag: " + entry->etag + "\r\n"
+            "Accept-Ranges: bytes\r\n";
+        entry->header_keep_alive = common + "Connection: keep-alive\r\n\r\n";
+        entry->header_close      = common + "Connection: close\r\n\r\n";
+        return entry;
+    }
+
+    using lru_list = std::list<std::pair<std::string, std::shared_ptr<file_entry>>>;
+    lru_list lru_;
+    std::unordered_map<std::string, lru_list::iterator> index_;
+    size_t capacity_;
+};
+
+access_logger* access_log = nullptr;
+
+// CGI 的 access log 要等兩件事都發生才寫：response 結束 (或整個交給 CGI) 以及 child 被回收
+class cgi_tracker {
+public:
+    void started(pid_t pid, const access_record& rec,
+                 std::chrono::steady_clock::time_point start, bool response_done) {
+        auto& p = pending_[pid];
+        p.rec = rec;
+        p.rec.pid = pid;
+        p.start = start;
+        p.response_done = response_done;
+        p.exited = false;
+    }
+
+    void response_done(pid_t pid, int status, long long bytes) {
+        auto it = pending_.find(pid);
+        if (it == pending_.end() || it->second.response_done) return;
+        it->second.rec.status = status;
+        it->second.rec.bytes = bytes;
+        it->second.response_done = true;
+        finish(it);
+    }
+
+    // 還沒被回收：pid 只有 SIGCHLD 那邊 waitpid 之後才會被重複使用，所以這時送 signal 是安全的
+    bool running(pid_t pid) const {
+        auto it = pending_.find(pid);
+        return it != pending_.end() && !it->second.exited;
+    }
+
+    // 逾時的 CGI：先 SIGTERM，cgi_kill_grace 之後還沒被回收就 SIGKILL；回收照樣由 SIGCHLD 那邊做
+    void terminate(pid_t pid, const boost::asio::any_io_executor& ex) {
+        if (!running(pid)) return;
+        ::kill(pid, SIGTERM);
+        auto timer = std::make_shared<boost::asio::steady_timer>(ex, cgi_kill_grace);
+        timer->async_wait([this, pid, timer](boost::system::error_code) {
+            if (running(pid)) ::kill(pid, SIGKILL);
+        });
+    }
+
+    void exited(pid_t pid, int wait_status) {
+        auto it = pending_.find(pid);
+        if (it == pending_.end()) return;
+        it->second.rec.exit_status = WIFEXITED(wait_status) ? WEXITSTATUS(wait_status)
+                                                            : 128 + WTERMSIG(wait_status);
+        it->second.exited = true;
+        finish(it);
+    }
+
+private:
+    struct pending {
+        access_record rec;
+        std::chrono::steady_clock::time_point start;
+        bool response_done, exited;
+    };
+
+    void finish(std::unordered_map<pid_t, pending>::iterator it) {
+        if (!it->second.response_done || !it->second.exited) return;
+        auto& rec = it->second.rec;
+        rec.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - it->second.start).count();
+        rec.time = time(nullptr);
+        if (access_log) access_log->log(rec);
+        pending_.erase(it);
+    }
+
+    std::unordered_map<pid_t, pending> pending_;
+};
+
+cgi_tracker cgis;
+
+// ---------- relay buffers ----------
+
+// relay mode 共用的 buffer 池；還回來時超過上限就直接釋放
+class buffer_pool {
+public:
+    std::unique_ptr<char[]> acquire() {
+        if (free_.empty()) return std::unique_ptr<char[]>(new char[relay_buffer_size]);
+        auto b = std::move(free_.back());
+        free_.pop_back();
+        return b;
+    }
+    void release(std::unique_ptr<char[]> b) {
+        if (b && free_.size() < relay_pool_max) free_.push_back(std::move(b));
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]>> free_;
+};
+
+buffer_pool relay_pool;
+
+// ---------- CGI environment ----------
+
+// fork 前組好整個 CGI/1.1 環境：一塊連續記憶體，前段是 envp 指標陣列，
+// 後段是 "NAME=value\0" 字串，child 直接交給 execve
+class cgi_env {
+public:
+    cgi_env() { vars_.reserve(32); }
+
+    void set(const std::string& name, const std::string& value) {
+        vars_.push_back(name + "=" + value);
+    }
+
+    char* const* envp() {
+        size_t bytes = 0;
+        for (auto& v : vars_) bytes += v.size() + 1;
+        size_t table = (vars_.size() + 1) * sizeof(char*);
+        block_.reset(new char[table + bytes]);
+
+        char** ptrs = reinterpret_cast<char**>(block_.get());
+        char* text = block_.get() + table;
+        for (auto& v : vars_) {
+            *ptrs++ = text;
+            std::memcpy(text, v.c_str(), v.size() + 1);
+            text += v.size() + 1;
+        }
+        *ptrs = nullptr;
+        vars_.clear();
+        return reinterpret_cast<char* const*>(block_.get());
+    }
+
+private:
+    std::vector<std::string> vars_;
+    std::unique_ptr<char[]> block_;
+};
+
 class session : public std::enable_shared_from_this<session>
 {
   public:
-    session(tcp::socket socket)
-        : socket_(std::move(socket)){}
+    session(tcp::socket socket, file_cache& cache,
+            connection_limiter& limiter, boost::asio::ip::address ip)
+        : socket_(std::move(socket)), cache_(cache),
+          limiter_(limiter), ip_(std::move(ip)),
+          deadline_(socket_.get_executor()){}
+
+    ~session()
+    {
+        if (pid_) cgis.response_done(pid_, status_, bytes_out_);
+        limiter_.release(ip_);
+        relay_pool.release(std::move(relay_read_buf_));
+        for (auto& c : relay_ready_) relay_pool.release(std::move(c.data));
+        relay_pool.release(std::move(relay_write_buf_.data));
+    }
 
     void start()
     {
+        set_deadline(header_timeout, &reject_counters::header_timeout);
         do_read();
     }
 
   private:
+    // 每個階段一個期限；時間到就關掉連線。timer 只拿 weak_ptr，不延長 session 壽命
+    void set_deadline(std::chrono::steady_clock::duration d,
+                      unsigned long long reject_counters::* counter){
+        std::weak_ptr<session> weak(shared_from_this());
+        deadline_.expires_after(d);
+        deadline_.async_wait([weak, counter](boost::system::error_code ec) {
+            auto self = weak.lock();
+            if (ec || !self) return;
+            ++(rejects.*counter);
+            if (self->pid_) cgis.terminate(self->pid_, self->socket_.get_executor());
+            self->out_pipe_.reset();
+            self->body_pipe_.reset();
+            boost::system::error_code ignored;
+            self->socket_.close(ignored);
+        });
+    }
+
+    void clear_deadline(){ deadline_.cancel(); }
+
   // asynchoronus read until \r\n\r\n
     void do_read()
     {
@@ -44,9 +441,17 @@ class session : public std::enable_shared_from_this<session>
             {
                 if (!ec)
                 {
+                    // keep-alive 閒置中收到第一個 byte，改用 header 期限
+                    if (request_.empty())
+                        set_deadline(header_timeout, &reject_counters::header_timeout);
                     request_ += std::string(data_, length);
-                    if(request_.find(HEADER_END) != std::string::npos){
+                    size_t end = request_.find(HEADER_END);
+                    if (end != std::string::npos && end + 4 <= options.max_header_bytes){
                         handle_request();
+                    } else if (end != std::string::npos ||
+                               request_.size() > options.max_header_bytes) {
+                        ++rejects.header_too_large;
+                        send_431();
                     } else {
                         do_read(); // not finish reading yet. 
                     }
@@ -55,158 +460,900 @@ class session : public std::enable_shared_from_this<session>
     }
 
     void handle_request(){
+        clear_deadline();
+        // keep-alive 時 request_ 後面可能已經有下一個 request
+        header_len_ = request_.find(HEADER_END) + std::strlen(HEADER_END);
+        if (header_len_ > options.max_header_bytes) {
+            ++rejects.header_too_large;
+            send_431();
+            return;
+        }
+
         //method uri protcol
-        std::istringstream iss(request_);
+        std::istringstream iss(request_.substr(0, header_len_));
         std::string method, uri, protocol;
         iss >> method >> uri >> protocol; //this will left \r\n
+        method_ = method;
+        uri_ = uri;
+        start_ = std::chrono::steady_clock::now();
+        bytes_out_ = 0;
 
         //to eat left "\r\n"
         std::string dummy;
         std::getline(iss, dummy); // read '\r' to dummuy, and getline discards the terminator '\n'
 
-        if(method != "GET"){ send_400(); return; }
-        if (!std::regex_match(uri, std::regex(R"(/[\w\-.]+\.cgi(\?.*)?)"))) {
-            send_404(); return;
+        //headers, name: value
+        std::string line;
+        headers_.clear();
+        while( std::getline(iss, line) && line != "\r"){
+            auto colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string value = line.substr(colon + 1);
+            //erase space and \r
+            value.erase(0, value.find_first_not_of(" \t"));
+            value.erase(value.find_last_not_of(" \t\r\n")+1);
+            headers_.emplace_back(line.substr(0, colon), value);
         }
 
-        //host header
-        std::string line, host_header;
-        while( std::getline(iss, line) && line != "\r"){
-            if (line.rfind("Host:", 0) == 0){
-                host_header = line.substr(5);
-                //erase space and \r
-                host_header.erase(0, host_header.find_first_not_of(" \t"));
-                host_header.erase(host_header.find_last_not_of("\r\n")+1);
-            }
+        std::string connection = header("Connection");
+        keep_alive_ = (protocol == "HTTP/1.1")
+                    ? strcasecmp(connection.c_str(), "close") != 0
+                    : strcasecmp(connection.c_str(), "keep-alive") == 0;
+        chunked_ = (protocol == "HTTP/1.1");
+
+        // /xxx.cgi[/path/info][?query]
+        static const std::regex cgi_re(R"((/[\w\-.]+\.cgi)(/[^?]*)?(?:\?(.*))?)");
+        std::smatch cgi;
+        if (!std::regex_match(uri, cgi, cgi_re)) {
+            if(method != "GET" && method != "HEAD"){ send_400(); return; }
+            serve_static(method, uri);
+            return;
         }
+        if(method != "GET" && method != "POST"){ send_400(); return; }
 
-        //URI / Query
-        std::string cgi_path = "." + uri;
-        std::string query_string;
-        auto qpos = uri.find('?');
-        if(qpos != std::string::npos){
-            cgi_path = "." + uri.substr(0, qpos); //"." + /xxx.cgi
-            query_string = uri.substr(qpos + 1);
+        // POST body 之後由 parent 一段一段轉進 CGI 的 stdin
+        body_remaining_ = 0;
+        std::string content_length = header("Content-Length");
+        if (method == "POST") {
+            if (content_length.empty()) { send_411(); return; }
+            // stoull 會收 "-1"（變成 2^64-1）和前後空白，先確定全是數字
+            if (content_length.find_first_not_of("0123456789") != std::string::npos) {
+                send_400(); return;
+            }
+            try {
+                body_remaining_ = std::stoull(content_length);
+            } catch (const std::exception&) {
+                send_400(); return;
+            }
         }
 
-        // HTTP response header
+        std::string script_name = cgi[1];
+        std::string path_info   = cgi[2];
+        cgi_path_ = "." + script_name; //"." + /xxx.cgi
+        build_cgi_env(method, uri, protocol, script_name, path_info, cgi[3],
+                      content_length);
+
+        // HTTP response header；relay mode 等 CGI 的 header 出來再組
         auto self(shared_from_this());
-        const std::string resp_header = "HTTP/1.1 200 OK\r\n";
+        response_header_ = options.relay ? "" : "HTTP/1.1 200 OK\r\n";
+        if (strcasecmp(header("Expect").c_str(), "100-continue") == 0)
+            response_header_.insert(0, "HTTP/1.1 100 Continue\r\n\r\n");
+        if (response_header_.empty()) {
+            launch_cgi();
+            return;
+        }
 
-        boost::asio::async_write(socket_, boost::asio::buffer(resp_header),
-                          [this, self, protocol, uri, query_string,
-                           host_header, cgi_path](boost::system::error_code ec, std::size_t) {
+        boost::asio::async_write(socket_, boost::asio::buffer(response_header_),
+                          [this, self](boost::system::error_code ec, std::size_t) {
             if (!ec) {
-                launch_cgi(protocol, uri, query_string,
-                           host_header, cgi_path);
+                launch_cgi();
             }
         });
     }
 
-    void launch_cgi(const std::string& protocol,
-                    const std::string& uri,
-                    const std::string& query,
-                    const std::string& host,
-                    const std::string& path){
+    // endpoint 與所有變數都在 parent 查好，child 不需要再碰 socket_
+    void build_cgi_env(const std::string& method,
+                       const std::string& uri,
+                       const std::string& protocol,
+                       const std::string& script_name,
+                       const std::string& path_info,
+                       const std::string& query,
+                       const std::string& content_length){
+        boost::system::error_code ec;
+        auto local_ep  = socket_.local_endpoint(ec);
+        auto remote_ep = socket_.remote_endpoint(ec);
+
+        std::string host = header("Host");
+        std::string server_name = host.substr(0, host.rfind(':'));
+        if (server_name.empty()) server_name = local_ep.address().to_string();
+
+        env_.set("GATEWAY_INTERFACE", "CGI/1.1");
+        env_.set("SERVER_SOFTWARE", "np_http_server");
+        env_.set("SERVER_NAME", server_name);
+        env_.set("SERVER_PROTOCOL", protocol);
+        env_.set("SERVER_ADDR", local_ep.address().to_string());
+        env_.set("SERVER_PORT", std::to_string(local_ep.port()));
+        env_.set("REMOTE_ADDR", remote_ep.address().to_string());
+        env_.set("REMOTE_PORT", std::to_string(remote_ep.port()));
+        env_.set("REQUEST_METHOD", method);
+        env_.set("REQUEST_URI", uri);
+        env_.set("QUERY_STRING", query);
+        env_.set("SCRIPT_NAME", script_name);
+        env_.set("SCRIPT_FILENAME", cgi_path_);
+        env_.set("PATH_INFO", path_info);
+        if (!path_info.empty()) env_.set("PATH_TRANSLATED", "." + path_info);
+        if (!content_length.empty()) {
+            env_.set("CONTENT_LENGTH", content_length);
+            env_.set("CONTENT_TYPE", header("Content-Type"));
+        }
+        env_.set("PATH", "/bin:/usr/bin"); //set PATH to search /bin first, then /usr/bin
+
+        // 其餘 request header 轉成 HTTP_*；Proxy 不轉，不然會變成 HTTP_PROXY（httpoxy），
+        // CGI 裡 libcurl / Go / Python 對外的 HTTP 都會被 client 導到它指定的 proxy
+        for (auto& h : headers_) {
+            if (strcasecmp(h.first.c_str(), "Content-Length") == 0 ||
+                strcasecmp(h.first.c_str(), "Content-Type") == 0 ||
+                strcasecmp(h.first.c_str(), "Proxy") == 0) continue;
+            std::string name = "HTTP_";
+            for (char c : h.first)
+                name += (c == '-') ? '_' : static_cast<char>(toupper(c));
+            env_.set(name, h.second);
+        }
+    }
+
+    // case-insensitive header lookup, "" if absent
+    std::string header(const char* name) const {
+        for (auto& h : headers_)
+            if (strcasecmp(h.first.c_str(), name) == 0) return h.second;
+        return "";
+    }
+
+    // 非 .cgi 的路徑當作 doc_root 底下的靜態檔案；"/." 開頭的 segment（.. 和隱藏檔）一律不給
+    void serve_static(const std::string& method,
+                      const std::string& uri){
+        std::string path = uri.substr(0, uri.find('?'));
+        if (path.empty() || path[0] != '/' ||
+            path.find("/.") != std::string::npos) {
+            send_404(); return;
+        }
+        if (path.back() == '/') path += "index.html";
+
+        auto file = cache_.lookup(options.doc_root + path);
+        if (!file) { send_404(); return; }
+
+        const char* conn_line = keep_alive_ ? "Connection: keep-alive\r\n"
+                                            : "Connection: close\r\n";
+
+        // conditional GET: If-None-Match 優先於 If-Modified-Since
+        std::string inm = header("If-None-Match");
+        std::string ims = header("If-Modified-Since");
+        time_t since;
+        bool not_modified = !inm.empty()
+            ? (inm == "*" || inm.find(file->etag) != std::string::npos)
+            : (!ims.empty() && parse_http_date(ims, since) && file->mtime <= since);
+        if (not_modified) {
+            send_static("HTTP/1.1 304 Not Modified\r\n"
+                        "ETag: " + file->etag + "\r\n"
+                        "Last-Modified: " + file->last_modified + "\r\n" +
+                        conn_line + "\r\n", nullptr, 0, 0);
+            return;
+        }
+
+        // 只支援單一 range；If-Range 不符時回傳整個檔案
+        std::string range = header("Range");
+        std::string if_range = header("If-Range");
+        if (!range.empty() && (if_range.empty() || if_range == file->etag)) {
+            off_t first, last;
+            if (!parse_range(range, file->size, first, last)) {
+                send_static("HTTP/1.1 416 Range Not Satisfiable\r\n"
+                            "Content-Range: bytes */" + std::to_string(file->size) + "\r\n"
+                            "Content-Length: 0\r\n" + conn_line + "\r\n",
+                            nullptr, 0, 0);
+                return;
+            }
+            std::string hdr = "HTTP/1.1 206 Partial Content\r\n"
+                "Content-Type: " + file->content_type + "\r\n"
+                "Content-Length: " + std::to_string(last - first + 1) + "\r\n"
+                "Content-Range: bytes " + std::to_string(first) + "-" +
+                    std::to_string(last) + "/" + std::to_string(file->size) + "\r\n"
+                "Last-Modified: " + file->last_modified + "\r\n"
+                "ETag: " + file->etag + "\r\n" + conn_line + "\r\n";
+            send_static(std::move(hdr), method == "HEAD" ? nullptr : file,
+                        first, last - first + 1);
+            return;
+        }
+
+        send_static(keep_alive_ ? file->header_keep_alive : file->header_close,
+                    method == "HEAD" ? nullptr : file, 0, file->size);
+    }
+
+    // "bytes=a-b" / "bytes=a-" / "bytes=-n"
+    static bool parse_range(const std::string& range, off_t size,
+                            off_t& first, off_t& last) {
+        if (range.compare(0, 6, "bytes=") != 0 || size == 0) return false;
+        std::string spec = range.substr(6);
+        auto dash = spec.find('-');
+        if (dash == std::string::npos || spec.find(',') != std::string::npos)
+            return false;
+        std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+        if (a.empty() && b.empty()) return false;
+        try {
+            if (a.empty()) {                  // suffix range
+                off_t n = std::stoll(b);
+                if (n <= 0) return false;
+                first = n >= size ? 0 : size - n;
+                last  = size - 1;
+            } else {
+                first = std::stoll(a);
+                last  = b.empty() ? size - 1 : std::min<off_t>(std::stoll(b), size - 1);
+            }
+        } catch (const std::exception&) {
+            return false;
+        }
+        return first >= 0 && first < size && first <= last;
+    }
+
+    // header 用 async_write，body 用 sendfile 直接從 fd 送出
+    void send_static(std::string hdr, std::shared_ptr<const file_entry> file,
+                     off_t offset, size_t count){
+        auto self(shared_from_this());
+        response_header_ = std::move(hdr);
+        status_ = status_of(response_header_);
+        boost::asio::async_write(socket_, boost::asio::buffer(response_header_),
+            [this, self, file, offset, count](boost::system::error_code ec, std::size_t n) {
+                bytes_out_ += n;
+                if (ec) { log_request(status_, bytes_out_); return; }
+                if (file && count > 0) send_file_body(file, offset, count);
+                else finish_static();
+            });
+    }
+
+    void send_file_body(std::shared_ptr<const file_entry> file,
+                        off_t offset, size_t remaining){
+        socket_.native_non_blocking(true);
+        while (remaining > 0) {
+            ssize_t n = ::sendfile(socket_.native_handle(), file->fd,
+                                   &offset, remaining);
+            if (n > 0) { remaining -= n; bytes_out_ += n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // socket buffer 滿了，等可寫再繼續
+                auto self(shared_from_this());
+                socket_.async_wait(tcp::socket::wait_write,
+                    [this, self, file, offset, remaining](boost::system::error_code ec) {
+                        if (!ec) send_file_body(file, offset, remaining);
+                        else log_request(status_, bytes_out_);
+                    });
+                return;
+            }
+            // 檔案被截短或連線出錯
+            log_request(status_, bytes_out_);
+            socket_.close();
+            return;
+        }
+        finish_static();
+    }
+
+    void finish_static(){
+        log_request(status_, bytes_out_);
+        request_.erase(0, header_len_);
+        next_request();
+    }
+
+    // keep-alive: request_ 只剩下還沒處理的資料，繼續處理下一個
+    void next_request(){
+        if (!keep_alive_) {
+            boost::system::error_code ignored;
+            socket_.shutdown(tcp::socket::shutdown_send, ignored);
+            socket_.close();
+            return;
+        }
+        if (request_.find(HEADER_END) != std::string::npos) {
+            handle_request();
+            return;
+        }
+        if (request_.empty())
+            set_deadline(keep_alive_timeout, &reject_counters::idle_timeout);
+        else
+            set_deadline(header_timeout, &reject_counters::header_timeout);
+        do_read();
+    }
+
+    void launch_cgi(){
+        char* const* envp = env_.envp();
+        char* const argv[] = { const_cast<char*>(cgi_path_.c_str()), nullptr };
+        int sock = socket_.native_handle();
+
+        // POST: CGI 的 stdin 接到 pipe，body 由 parent 寫進去
+        int body_pipe[2] = { -1, -1 };
+        if (body_remaining_ > 0) {
+            if (pipe2(body_pipe, O_CLOEXEC) < 0) { socket_.close(); return; }
+        }
+        // relay mode: CGI 的 stdout 接到 pipe，由 server 讀出來再送給 client
+        int out_pipe[2] = { -1, -1 };
+        if (options.relay && pipe2(out_pipe, O_CLOEXEC) < 0) {
+            socket_.close();
+            return;
+        }
+
         //fork
         pid_t pid;
         while ((pid = fork()) < 0) {
-            waitpid(-1, nullptr, 0);
+            int status;
+            pid_t done = waitpid(-1, &status, 0);
+            if (done > 0) cgis.exited(done, status);
         }
         if(pid == 0){ //child
-            dup2(socket_.native_handle(), STDOUT_FILENO);
-            dup2(socket_.native_handle(), STDERR_FILENO);
-
-            setenv("REQUEST_METHOD", "GET", 1);
-            setenv("REQUEST_URI", uri.c_str(), 1);
-            setenv("QUERY_STRING", query.c_str(), 1);
-            setenv("SERVER_PROTOCOL", protocol.c_str(), 1);
-            setenv("HTTP_HOST", host.c_str(), 1);
-
-            auto local_ep = socket_.local_endpoint();
-            auto remote_ep = socket_.remote_endpoint();
-            setenv("SERVER_ADDR",
-                    local_ep.address().to_string().c_str(), 1);
-            setenv("SERVER_PORT",
-                    std::to_string(local_ep.port()).c_str(), 1);
-            setenv("REMOTE_ADDR",
-                    remote_ep.address().to_string().c_str(), 1);
-            setenv("REMOTE_PORT",
-                    std::to_string(remote_ep.port()).c_str(), 1);       
-            
-            socket_.close();
-
-            setenv("PATH", "/bin:/usr/bin", 1); //set PATH to search /bin first, then /usr/bin
+            if (body_pipe[0] >= 0) dup2(body_pipe[0], STDIN_FILENO);
+            if (out_pipe[1] >= 0) {
+                dup2(out_pipe[1], STDOUT_FILENO); // stderr 留在 server 的 stderr
+            } else {
+                dup2(sock, STDOUT_FILENO); // stderr 不再送到 client
+                // asio 把 socket 設成 non-blocking，CGI 的 stdout 要是 blocking
+                fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_NONBLOCK);
+            }
+            ::close(sock);
+            signal(SIGPIPE, SIG_DFL);
 
             //exec cgi
-            execlp(path.c_str(), path.c_str(), nullptr);
-            // if exec fail
-            std::cerr << "Exec error: " << strerror(errno) << std::endl;
-            exit(EXIT_FAILURE);
+            execve(argv[0], argv, envp);
+            // if exec fail：parent 有 logger thread，fork 之後只能用 async-signal-safe 的 write，
+            // iostream 的 lock 可能正被別的 thread 拿著
+            static const char exec_error[] = "Exec error: cannot execute CGI\n";
+            ssize_t ignored = ::write(STDERR_FILENO, exec_error, sizeof(exec_error) - 1);
+            (void)ignored;
+            _exit(127);
         }
         //parent
-        socket_.close(); 
+        // 非 relay mode 時 response 交給 CGI，server 這邊不知道送了多少
+        pid_ = pid;
+        status_ = 200;
+        cgis.started(pid, make_record(status_, -1), start_, !options.relay);
+        if (!options.relay) pid_ = 0;
+
+        if (out_pipe[1] >= 0) {
+            ::close(out_pipe[1]);
+            out_pipe_.reset(new boost::asio::posix::stream_descriptor(
+                socket_.get_executor(), out_pipe[0]));
+            set_deadline(cgi_start_timeout, &reject_counters::cgi_timeout);
+            relay_read_header();
+        }
+
+        // header 之後已經讀進來的那一段 body 先寫，剩下的留給下一個 request
+        size_t buffered = std::min<size_t>(request_.size() - header_len_, body_remaining_);
+        body_buf_ = request_.substr(header_len_, buffered);
+        request_.erase(0, header_len_ + buffered);
+        body_remaining_ -= buffered;
+
+        if (body_pipe[0] < 0) {
+            if (!options.relay) socket_.close();
+            return;
+        }
+        ::close(body_pipe[0]);
+        body_pipe_.reset(new boost::asio::posix::stream_descriptor(
+            socket_.get_executor(), body_pipe[1]));
+        write_body(body_buf_.data(), body_buf_.size());
+    }
+
+    void write_body(const char* data, size_t n){
+        auto self(shared_from_this());
+        boost::asio::async_write(*body_pipe_, boost::asio::buffer(data, n),
+            [this, self](boost::system::error_code ec, std::size_t) {
+                if (ec || body_remaining_ == 0) { finish_body(); return; }
+                read_body();
+            });
+    }
+
+    // child 會把 socket 改回 blocking，所以只用 async_wait + MSG_DONTWAIT 讀
+    void read_body(){
+        auto self(shared_from_this());
+        socket_.async_wait(tcp::socket::wait_read,
+            [this, self](boost::system::error_code ec) {
+                if (ec) { finish_body(); return; }
+                ssize_t n = ::recv(socket_.native_handle(), data_,
+                                   std::min<size_t>(max_length, body_remaining_),
+                                   MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    read_body();
+                    return;
+                }
+                if (n <= 0) { finish_body(); return; }
+                body_remaining_ -= n;
+                write_body(data_, n);
+            });
+    }
+
+    // 關掉 pipe，CGI 讀到 EOF；非 relay mode 時 socket 留給 child
+    void finish_body(){
+        body_pipe_.reset();
+        if (body_remaining_ > 0) keep_alive_ = false; // 剩下的 body 還在 socket 上
+        if (!options.relay) socket_.close();
+        else if (!out_pipe_ && socket_.is_open()) next_request(); // response 已經先送完
+    }
+
+    // ---------- relay mode ----------
+
+    // 先讀到 CGI 自己輸出的 header，轉成 HTTP response header
+    void relay_read_header(){
+        auto self(shared_from_this());
+        if (!relay_read_buf_) relay_read_buf_ = relay_pool.acquire();
+        out_pipe_->async_read_some(boost::asio::buffer(relay_read_buf_.get(), relay_buffer_size),
+            [this, self](boost::system::error_code ec, std::size_t n) {
+                if (ec) { send_502(); return; }
+                cgi_header_.append(relay_read_buf_.get(), n);
+
+                size_t end = cgi_header_.find("\r\n\r\n"), sep = 4;
+                size_t lf = cgi_header_.find("\n\n");
+                if (lf != std::string::npos && lf < end) { end = lf; sep = 2; }
+                if (end == std::string::npos) {
+                    if (cgi_header_.size() > cgi_header_max) send_502();
+                    else relay_read_header();
+                    return;
+                }
+
+                clear_deadline();
+                build_relay_header(cgi_header_.substr(0, end));
+                // header 後面已經讀到的 body 當作第一個 chunk
+                size_t rest = cgi_header_.size() - end - sep;
+                if (rest > 0) {
+                    std::memcpy(relay_read_buf_.get(), cgi_header_.data() + end + sep, rest);
+                    relay_ready_.push_back({std::move(relay_read_buf_), rest});
+                }
+                cgi_header_.clear();
+                relay_pump();
+            });
+    }
+
+    // Status: 決定狀態碼，其他 header 原樣轉送；長度交給 chunked encoding
+    void build_relay_header(const std::string& cgi_header){
+        std::string status = "200 OK", fields;
+        bool has_location = false, has_status = false;
+        std::istringstream iss(cgi_header);
+        std::string line;
+        while (std::getline(iss, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            auto colon = line.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = line.substr(0, colon);
+            std::string value = line.substr(colon + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            if (strcasecmp(name.c_str(), "Status") == 0) {
+                status = value; has_status = true;
+                continue;
+            }
+            if (strcasecmp(name.c_str(), "Content-Length") == 0 ||
+                strcasecmp(name.c_str(), "Transfer-Encoding") == 0 ||
+                strcasecmp(name.c_str(), "Connection") == 0) continue;
+            if (strcasecmp(name.c_str(), "Location") == 0) has_location = true;
+            fields += line + "\r\n";
+        }
+        if (has_location && !has_status) status = "302 Found";
+        if (!chunked_) keep_alive_ = false; // HTTP/1.0: 以關連線表示結束
+
+        response_header_ = "HTTP/1.1 " + status + "\r\n" + fields;
+        status_ = std::atoi(status.c_str());
+        if (chunked_) response_header_ += "Transfer-Encoding: chunked\r\n";
+        response_header_ += keep_alive_ ? "Connection: keep-alive\r\n\r\n"
+                                        : "Connection: close\r\n\r\n";
+        header_sent_ = false;
+        crlf_pending_ = false;
+        relay_eof_ = false;
+    }
+
+    // 一次只有一個 write；讀最多領先 relay_window 塊，client 慢的時候 pipe 塞滿，CGI 就會被擋住
+    void relay_pump(){
+        if (!relay_writing_) {
+            if (!header_sent_ || !relay_ready_.empty() || relay_eof_) relay_write();
+            else if (options.splice) { relay_splice(); return; }
+        }
+        if (!options.splice && !relay_reading_ && !relay_eof_ &&
+            relay_ready_.size() + (relay_writing_ ? 1 : 0) < relay_window)
+            relay_read();
+    }
+
+    void relay_read(){
+        auto self(shared_from_this());
+        relay_reading_ = true;
+        if (!relay_read_buf_) relay_read_buf_ = relay_pool.acquire();
+        out_pipe_->async_read_some(boost::asio::buffer(relay_read_buf_.get(), relay_buffer_size),
+            [this, self](boost::system::error_code ec, std::size_t n) {
+                relay_reading_ = false;
+                if (ec) {
+                    relay_eof_ = true;
+                    relay_pool.release(std::move(relay_read_buf_));
+                } else {
+                    relay_ready_.push_back({std::move(relay_read_buf_), n});
+                }
+                relay_pump();
+            });
+    }
+
+    // header、chunk size、資料、結尾合成一個 gather write
+    void relay_write(){
+        auto self(shared_from_this());
+        std::vector<boost::asio::const_buffer> bufs;
+        if (!header_sent_) bufs.push_back(boost::asio::buffer(response_header_));
+        chunk_prefix_.clear();
+        if (crlf_pending_ && chunked_) chunk_prefix_ = "\r\n";
+        crlf_pending_ = false;
+
+        if (!relay_ready_.empty()) {
+            relay_write_buf_ = std::move(relay_ready_.front());
+            relay_ready_.pop_front();
+            if (chunked_) {
+                char size_line[32];
+                snprintf(size_line, sizeof(size_line), "%zx\r\n", relay_write_buf_.len);
+                chunk_prefix_ += size_line;
+            }
+            crlf_pending_ = true;
+        }
+        bool last = relay_eof_ && relay_ready_.empty() && !relay_write_buf_.data;
+        if (last && chunked_) chunk_prefix_ += "0\r\n\r\n";
+
+        bufs.push_back(boost::asio::buffer(chunk_prefix_));
+        if (relay_write_buf_.data)
+            bufs.push_back(boost::asio::buffer(relay_write_buf_.data.get(), relay_write_buf_.len));
+
+        relay_writing_ = true;
+        boost::asio::async_write(socket_, bufs,
+            [this, self, last](boost::system::error_code ec, std::size_t n) {
+                relay_writing_ = false;
+                header_sent_ = true;
+                bytes_out_ += n;
+                relay_pool.release(std::move(relay_write_buf_.data));
+                relay_write_buf_.len = 0;
+                if (ec) { relay_abort(); return; }
+                if (last) { relay_done(); return; }
+                relay_pump();
+            });
+    }
+
+    // 零複製：FIONREAD 得到 pipe 裡的量，送出 chunk size 後 splice 同樣的量到 socket
+    void relay_splice(){
+        auto self(shared_from_this());
+        int fd = out_pipe_->native_handle();
+        int avail = 0;
+        if (ioctl(fd, FIONREAD, &avail) < 0 || avail == 0) {
+            out_pipe_->async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                [this, self](boost::system::error_code ec) {
+                    if (ec) { relay_abort(); return; }
+                    // 喚醒時 pipe 可能還是空的；沒資料又 POLLHUP 才是 CGI 關掉 stdout
+                    struct pollfd pfd = { out_pipe_->native_handle(), POLLIN, 0 };
+                    int avail = 0;
+                    ioctl(pfd.fd, FIONREAD, &avail);
+                    if (avail == 0 && ::poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP))
+                        relay_eof_ = true;
+                    if (relay_eof_) relay_pump();
+                    else relay_splice();
+                });
+            return;
+        }
+
+        splice_left_ = avail;
+        chunk_prefix_ = (crlf_pending_ && chunked_) ? "\r\n" : "";
+        if (chunked_) {
+            char size_line[32];
+            snprintf(size_line, sizeof(size_line), "%x\r\n", avail);
+            chunk_prefix_ += size_line;
+        }
+        crlf_pending_ = true;
+        relay_writing_ = true;
+        boost::asio::async_write(socket_, boost::asio::buffer(chunk_prefix_),
+            [this, self](boost::system::error_code ec, std::size_t n) {
+                if (ec) { relay_abort(); return; }
+                bytes_out_ += n;
+                splice_body();
+            });
+    }
+
+    void splice_body(){
+        int pipe_fd = out_pipe_->native_handle();
+        socket_.native_non_blocking(true);
+        while (splice_left_ > 0) {
+            ssize_t n = ::splice(pipe_fd, nullptr, socket_.native_handle(), nullptr,
+                                 splice_left_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) { splice_left_ -= n; bytes_out_ += n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                auto self(shared_from_this());
+                socket_.async_wait(tcp::socket::wait_write,
+                    [this, self](boost::system::error_code ec) {
+                        if (ec) relay_abort();
+                        else splice_body();
+                    });
+                return;
+            }
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                // 不支援 splice：這個 chunk 剩下的已經在 pipe 裡，讀出來照一般方式送，之後都不再 splice
+                options.splice = false;
+                splice_fallback();
+                return;
+            }
+            relay_abort();
+            return;
+        }
+        relay_writing_ = false;
+        relay_pump();
+    }
+
+    void splice_fallback(){
+        splice_rest_.resize(splice_left_);
+        size_t got = 0;
+        while (got < splice_left_) {
+            ssize_t n = ::read(out_pipe_->native_handle(), &splice_rest_[got], splice_left_ - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { relay_abort(); return; }
+            got += n;
+        }
+        auto self(shared_from_this());
+        boost::asio::async_write(socket_, boost::asio::buffer(splice_rest_),
+            [this, self](boost::system::error_code ec, std::size_t n) {
+                if (ec) { relay_abort(); return; }
+                bytes_out_ += n;
+                splice_left_ = 0;
+                relay_writing_ = false;
+                relay_pump();
+            });
+    }
+
+    void relay_done(){
+        out_pipe_.reset();
+        cgi_response_done();
+        // body 還沒轉完就先不接下一個 request
+        if (!body_pipe_) next_request();
+    }
+
+    void relay_abort(){
+        out_pipe_.reset();
+        cgi_response_done();
+        body_pipe_.reset();
+        socket_.close();
+    }
+
+    void cgi_response_done(){
+        if (!pid_) return;
+        cgis.response_done(pid_, status_, bytes_out_);
+        pid_ = 0;
+    }
+
+    // ---------- access log ----------
+
+    static int status_of(const std::string& hdr){
+        // 跳過 "HTTP/1.1 100 Continue" 這種中間回應
+        size_t pos = hdr.rfind("HTTP/1.1 ");
+        return pos == std::string::npos ? 0 : std::atoi(hdr.c_str() + pos + 9);
+    }
+
+    access_record make_record(int status, long long bytes) const {
+        access_record rec;
+        access_record::copy(rec.method, sizeof(rec.method), method_.empty() ? "-" : method_);
+        access_record::copy(rec.uri, sizeof(rec.uri), uri_.empty() ? "-" : uri_);
+        access_record::copy(rec.remote, sizeof(rec.remote), ip_.to_string());
+        rec.status = status;
+        rec.bytes = bytes;
+        rec.latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+        rec.time = time(nullptr);
+        return rec;
+    }
+
+    void log_request(int status, long long bytes){
+        if (access_log) access_log->log(make_record(status, bytes));
     }
 
     //error message to send and handler
     void send_common(const std::string& header) {
         auto self(shared_from_this());
-        boost::asio::async_write(socket_, boost::asio::buffer(header),
-                          [this, self](boost::system::error_code, std::size_t) {
+        if (method_.empty()) start_ = std::chrono::steady_clock::now();
+        cgi_response_done();
+        response_header_ = header;
+        boost::asio::async_write(socket_, boost::asio::buffer(response_header_),
+                          [this, self](boost::system::error_code, std::size_t n) {
+            log_request(status_of(response_header_), n);
             socket_.close();
         });
     }
     void send_400() { send_common("HTTP/1.1 400 Bad Request\r\n\r\n"); }
     void send_404() { send_common("HTTP/1.1 404 Not Found\r\n\r\n"); }
+    void send_411() { send_common("HTTP/1.1 411 Length Required\r\n\r\n"); }
+    void send_431() { send_common("HTTP/1.1 431 Request Header Fields Too Large\r\n\r\n"); }
+    void send_502() {
+        out_pipe_.reset();
+        status_ = 502;
+        send_common("HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\n\r\n");
+    }
 
     tcp::socket socket_;
+    file_cache& cache_;
+    connection_limiter& limiter_;
+    boost::asio::ip::address ip_;
+    boost::asio::steady_timer deadline_;
     char data_[max_length];
     std::string request_;
+    size_t header_len_ = 0;
+    std::vector<std::pair<std::string, std::string>> headers_;
+    std::string response_header_;
+    bool keep_alive_ = false;
+    std::string method_, uri_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+    int status_ = 0;
+    pid_t pid_ = 0;             // relay 中的 CGI，response 結束時通知 cgis
+    std::string cgi_path_;
+    cgi_env env_;
+    unsigned long long body_remaining_ = 0;
+    std::unique_ptr<boost::asio::posix::stream_descriptor> body_pipe_;
+    std::string body_buf_;
+
+    // relay mode
+    struct relay_chunk {
+        std::unique_ptr<char[]> data;
+        size_t len = 0;
+    };
+    std::unique_ptr<boost::asio::posix::stream_descriptor> out_pipe_;
+    std::unique_ptr<char[]> relay_read_buf_;
+    std::deque<relay_chunk> relay_ready_;
+    relay_chunk relay_write_buf_;
+    std::string cgi_header_, chunk_prefix_, splice_rest_;
+    size_t splice_left_ = 0;
+    size_t bytes_out_ = 0;      // 實際寫給 client 的 bytes (static / relay mode)
+    bool chunked_ = true;
+    bool header_sent_ = false, crlf_pending_ = false;
+    bool relay_reading_ = false, relay_writing_ = false, relay_eof_ = false;
 };
 
 class server
 {
 public:
   server(boost::asio::io_context& io_context, short port)
-    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port))
+    : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
+      cache_(file_cache_entries),
+      retry_timer_(io_context),
+      signals_(io_context, SIGUSR1),
+      children_(io_context, SIGCHLD)
   {
     do_accept();
+    wait_stats_signal();
+    wait_child_signal();
   }
 
 private:
   void do_accept()
   {
+    // 連線數滿了就不再 accept，留在 kernel backlog，等有 session 結束
+    if (limiter_.full())
+    {
+      ++rejects.accept_paused;
+      limiter_.on_available = [this] { do_accept(); };
+      return;
+    }
+
     acceptor_.async_accept(
         [this](boost::system::error_code ec, tcp::socket socket)
         {
-          if (!ec)
+          if (ec)
+          {
+            // EMFILE 之類的錯誤：稍等再 accept，避免空轉
+            ++rejects.accept_errors;
+            retry_timer_.expires_after(accept_retry_delay);
+            retry_timer_.async_wait([this](boost::system::error_code) { do_accept(); });
+            return;
+          }
+
+          boost::system::error_code ep_ec;
+          auto ip = socket.remote_endpoint(ep_ec).address();
+          if (!ep_ec && limiter_.try_acquire(ip))
           {
-            std::make_shared<session>(std::move(socket))->start();
+            std::make_shared<session>(std::move(socket), cache_, limiter_, ip)->start();
+          }
+          else if (!ep_ec)
+          {
+            ++rejects.per_ip_limit;
+            reject_busy(std::move(socket));
           }
 
           do_accept();
         });
   }
 
+  static void reject_busy(tcp::socket socket)
+  {
+    static const std::string busy =
+        "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+    auto sock = std::make_shared<tcp::socket>(std::move(socket));
+    boost::asio::async_write(*sock, boost::asio::buffer(busy),
+        [sock](boost::system::error_code, std::size_t) {});
+  }
+
+  void wait_stats_signal()
+  {
+    signals_.async_wait([this](boost::system::error_code ec, int)
+    {
+      if (ec) return;
+      std::cerr << "active=" << limiter_.active()
+                << " header_timeout=" << rejects.header_timeout
+                << " idle_timeout=" << rejects.idle_timeout
+                << " cgi_timeout=" << rejects.cgi_timeout
+                << " header_too_large=" << rejects.header_too_large
+                << " per_ip_limit=" << rejects.per_ip_limit
+                << " accept_paused=" << rejects.accept_paused
+                << " accept_errors=" << rejects.accept_errors << std::endl;
+      if (access_log) access_log->request_histogram();
+      wait_stats_signal();
+    });
+  }
+
+  // 回收 CGI，exit status 交給 access log
+  void wait_child_signal()
+  {
+    children_.async_wait([this](boost::system::error_code ec, int)
+    {
+      if (ec) return;
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        cgis.exited(pid, status);
+      wait_child_signal();
+    });
+  }
+
   tcp::acceptor acceptor_;
+  file_cache cache_;
+  connection_limiter limiter_;
+  boost::asio::steady_timer retry_timer_;
+  boost::asio::signal_set signals_;
+  boost::asio::signal_set children_;
 };
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 2)
+    if (argc < 2)
     {
-      std::cerr << "Usage: ./http_server <port>\n";
+      std::cerr << "Usage: ./http_server <port> [--relay] [--no-splice]"
+                   " [--max-conn N] [--max-per-ip N] [--max-header N]"
+                   " [--doc-root DIR] [--access-log PATH] [--access-log-max BYTES] [--no-access-log]\n";
       return 1;
     }
+    for (int i = 2; i < argc; ++i)
+    {
+      std::string opt = argv[i];
+      if (opt == "--relay") options.relay = true;
+      else if (opt == "--no-splice") options.splice = false;
+      else if (opt == "--max-conn" && i + 1 < argc) options.max_connections = std::stoul(argv[++i]);
+      else if (opt == "--max-per-ip" && i + 1 < argc) options.max_per_ip = std::stoul(argv[++i]);
+      else if (opt == "--max-header" && i + 1 < argc) options.max_header_bytes = std::stoul(argv[++i]);
+      else if (opt == "--doc-root" && i + 1 < argc) options.doc_root = argv[++i];
+      else if (opt == "--access-log" && i + 1 < argc) options.access_log = argv[++i];
+      else if (opt == "--access-log-max" && i + 1 < argc) options.access_log_max = std::stoul(argv[++i]);
+      else if (opt == "--no-access-log") options.access_log.clear();
+      else
+      {
+        std::cerr << "Unknown option: " << opt << "\n";
+        return 1;
+      }
+    }
+
+    signal(SIGPIPE, SIG_IGN); // CGI 不讀 stdin 就結束時，寫 body pipe 只回 EPIPE
+
+    std::unique_ptr<access_logger> logger;
+    if (!options.access_log.empty())
+    {
+      logger.reset(new access_logger(options.access_log, options.access_log_max));
+      access_log = logger.get();
+      // log 裡有每個 client 的 IP 和完整的 query string
+      private_files.push_back(canonical_path(options.access_log));
+      private_files.push_back(canonical_path(options.access_log + ".1"));
+    }
 
-    signal(SIGCHLD, reap_child);
-    
     boost::asio::io_context io_context;
 
     server s(io_context, std::atoi(argv[1]));
 
+    // 正常結束才能讓 logger 把 ring 裡剩下的寫完
+    boost::asio::signal_set stop(io_context, SIGINT, SIGTERM);
+    stop.async_wait([&](boost::system::error_code, int) { io_context.stop(); });
+
     io_context.run();
   }
   catch (std::exception& e)
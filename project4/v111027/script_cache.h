@@ -0,0 +1,192 @@
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+// console.cgi、cgi_server 共用的 test_case 讀取。
+// 同一個檔案只讀一次並先切好行，每個 session 只拿一個 cursor，
+// 開第 N 個跑同一檔案的 session 不用再讀檔。
+// 一般的 test_case 只有幾 KB，直接複製一份；大的才 mmap，而 mmap 的檔案被截短時
+// 碰到尾巴會 SIGBUS，所以每次取一行前先 fstat 確認那一行還在檔案裡。
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define SCRIPT_HAVE_MMAP 1
+#endif
+
+constexpr size_t script_copy_max     = 256 * 1024; // 這麼大以內的檔案複製一份，不 mmap
+constexpr size_t script_cache_entries = 64;        // LRU 最多留幾個檔案
+
+// 一個檔案的內容 + 每行的 (offset, length)，建好之後不會再改
+class script {
+public:
+    script(const script&) = delete;
+    script& operator=(const script&) = delete;
+
+    ~script() {
+#ifdef SCRIPT_HAVE_MMAP
+        if (mapped_) ::munmap(const_cast<char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+#endif
+    }
+
+    // 讀不到回傳 nullptr
+    static std::shared_ptr<script> load(const std::string& path) {
+        std::shared_ptr<script> s(new script);
+#ifdef SCRIPT_HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { ::close(fd); return nullptr; }
+        s->size_ = st.st_size;
+        if (s->size_ > script_copy_max) {
+            void* p = ::mmap(nullptr, s->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) { ::close(fd); return nullptr; }
+            s->data_ = static_cast<const char*>(p);
+            s->mapped_ = true;
+            s->fd_ = fd;           // 留著給 line() fstat
+            s->split();
+            return s;
+        }
+        s->owned_.resize(s->size_);
+        size_t done = 0;
+        while (done < s->size_) {
+            ssize_t n = ::read(fd, &s->owned_[done], s->size_ - done);
+            if (n <= 0) break;
+            done += n;
+        }
+        ::close(fd);
+        s->owned_.resize(done);    // 讀的時候被截短就只留讀到的
+        s->data_ = s->owned_.data();
+        s->size_ = s->owned_.size();
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in) return nullptr;
+        std::ostringstream ss;
+        ss << in.rdbuf();
+        s->owned_ = ss.str();
+        s->data_ = s->owned_.data();
+        s->size_ = s->owned_.size();
+#endif
+        s->split();
+        return s;
+    }
+
+    size_t lines() const { return lines_.size(); }
+
+    // 跟 std::getline 一樣：不含 '\n'，'\r' 保留。
+    // mmap 的檔案被截短到這一行之前就回傳 false（當作檔案結束），不去碰已經不存在的頁
+    bool line(size_t i, std::string& out) const {
+        size_t end = lines_[i].first + lines_[i].second;
+#ifdef SCRIPT_HAVE_MMAP
+        struct stat st;
+        if (mapped_ && (::fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < end))
+            return false;
+#endif
+        out.assign(data_ + lines_[i].first, end - lines_[i].first);
+        return true;
+    }
+
+private:
+    script() = default;
+
+    // 最後一行沒有 '\n' 也算一行，但檔尾的 '\n' 後面不多算一個空行
+    void split() {
+        size_t begin = 0;
+        for (size_t i = 0; i < size_; ++i) {
+            if (data_[i] != '\n') continue;
+            lines_.emplace_back(begin, i - begin);
+            begin = i + 1;
+        }
+        if (begin < size_) lines_.emplace_back(begin, size_ - begin);
+    }
+
+    const char* data_ = "";
+    size_t size_ = 0;
+    bool mapped_ = false;
+    int fd_ = -1;          // mmap 時開著的檔案
+    std::string owned_;    // 沒有 mmap 時的內容
+    std::vector<std::pair<size_t, size_t>> lines_;
+};
+
+// session 用的讀取位置，介面對應原本的 ifstream + getline
+class script_cursor {
+public:
+    script_cursor() = default;
+    explicit script_cursor(std::shared_ptr<const script> s) : script_(std::move(s)) {}
+
+    explicit operator bool() const { return script_ != nullptr; }
+
+    bool getline(std::string& line) {
+        if (!script_ || next_ >= script_->lines()) return false;
+        return script_->line(next_++, line);
+    }
+
+private:
+    std::shared_ptr<const script> script_;
+    size_t next_ = 0;
+};
+
+// path -> 已載入的 script；mtime 或大小變了就重新載入。
+// 最多留 script_cache_entries 個，LRU 淘汰；還在跑的 session 持有 shared_ptr，淘汰了也不影響
+class script_cache {
+public:
+    script_cursor open(const std::string& path) {
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0) return script_cursor();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(path);
+        if (it != index_.end()) {
+            const entry& e = it->second->second;
+            if (e.mtime == st.st_mtime && e.size == static_cast<size_t>(st.st_size)) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return script_cursor(e.content);
+            }
+            lru_.erase(it->second);
+            index_.erase(it);
+        }
+
+        auto s = script::load(path);
+        if (!s) return script_cursor();
+        lru_.emplace_front(path, entry{st.st_mtime, static_cast<size_t>(st.st_size), s});
+        index_[path] = lru_.begin();
+        while (lru_.size() > script_cache_entries) {
+            index_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return script_cursor(s);
+    }
+
+    static script_cache& instance() {
+        static script_cache cache;
+        return cache;
+    }
+
+private:
+    struct entry {
+        time_t mtime;
+        size_t size;
+        std::shared_ptr<const script> content;
+    };
+    using lru_list = std::list<std::pair<std::string, entry>>;
+    std::mutex mutex_;
+    lru_list lru_;
+    std::unordered_map<std::string, lru_list::iterator> index_;
+};
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Proxy: 這個 request header 不能變成 CGI 的 HTTP_PROXY（httpoxy）
+# 用法：tests/httpoxy.sh（在 project4/v111027 底下，先 make http_server）
+set -u
+server=$(realpath ./http_server)
+dir=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+
+cat > "$dir/env.cgi" <<'CGI'
+#!/bin/sh
+printf 'Content-Type: text/plain\r\n\r\n'
+echo "HTTP_PROXY=${HTTP_PROXY-unset}"
+echo "HTTP_X_OTHER=${HTTP_X_OTHER-unset}"
+CGI
+chmod +x "$dir/env.cgi"
+
+port=$((20000 + RANDOM % 10000))
+(cd "$dir" && exec "$server" $port --no-access-log) &
+pid=$!
+sleep 0.3
+
+out=$(curl -s -m 5 -H 'Proxy: x' -H 'X-Other: y' http://127.0.0.1:$port/env.cgi)
+if ! grep -q '^HTTP_X_OTHER=y$' <<<"$out"; then
+    echo "FAIL httpoxy: CGI did not run or headers not passed: $out"; exit 1
+fi
+if ! grep -q '^HTTP_PROXY=unset$' <<<"$out"; then
+    echo "FAIL httpoxy: CGI saw HTTP_PROXY: $out"; exit 1
+fi
+echo "PASS httpoxy"
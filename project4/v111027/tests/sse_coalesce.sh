@@ -0,0 +1,47 @@
+#!/bin/bash
+# cgi_server mode=events：遠端連續幾次 read 要併成同一個 data: frame，不是一次 read 一個 event
+# 用法：tests/sse_coalesce.sh（在 project4/v111027 底下；cgi_server 另外編一份 Linux 版，需要 python3）
+set -u
+src=$(realpath ./cgi_server.cpp)
+dir=$(mktemp -d)
+trap 'kill $pid $shell 2>/dev/null; rm -rf "$dir"' EXIT
+pid= shell=
+
+g++ -std=c++14 "$src" -o "$dir/cgi_server" -pthread -lboost_system -lz || {
+    echo "FAIL sse_coalesce: cannot build cgi_server"; exit 1; }
+
+mkdir "$dir/test_case"
+echo exit > "$dir/test_case/t1.txt"
+
+# 假的 np shell：a/b/c 分三次 send（中間隔幾 ms），再給 prompt，收到 exit 就關
+sport=$((20000 + RANDOM % 5000))
+python3 - $sport <<'PY' &
+import socket, sys, time
+s = socket.socket(); s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(("127.0.0.1", int(sys.argv[1]))); s.listen(1)
+c, _ = s.accept()
+for part in (b"a\n", b"b\n", b"c\n"):
+    c.sendall(part); time.sleep(0.005)
+c.sendall(b"% ")
+buf = b""
+while b"exit" not in buf:
+    d = c.recv(1024)
+    if not d: break
+    buf += d
+c.close()
+PY
+shell=$!
+
+port=$((25000 + RANDOM % 5000))
+(cd "$dir" && exec ./cgi_server $port) &
+pid=$!
+sleep 0.3
+
+out=$(curl -s -N -m 5 "http://127.0.0.1:$port/console.cgi?mode=events&h0=127.0.0.1&p0=$sport&f0=t1.txt")
+if ! grep -q '^event: end$' <<<"$out"; then
+    echo "FAIL sse_coalesce: no end event: $out"; exit 1
+fi
+if ! grep -q '^data: .*a\\nb\\nc\\n' <<<"$out"; then
+    echo "FAIL sse_coalesce: reads were not coalesced into one frame: $out"; exit 1
+fi
+echo "PASS sse_coalesce"
@@ -10,28 +10,10 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include "escape.h"
 
 using boost::asio::ip::tcp;
 
-
-std::string html_escape(const std::string& src) {
-    std::string out;
-    out.reserve(src.size()*2);
-    for (char c : src) {
-        switch (c) {
-            case '&':  out += "&amp;";  break;
-            case '<':  out += "&lt;";   break;
-            case '>':  out += "&gt;";   break;
-            case '"':  out += "&quot;"; break;
-            case '\'': out += "&#39;";  break;
-            case '\n': out += "&NewLine;"; break;
-            case '\r': break;
-            default:   out += c;
-        }
-    }
-    return out;
-}
-
 // Insert the server response into the corresponding <pre id='sX'>
 void output_shell(int id, const std::string& msg) {
     std::cout << "<script>document.getElementById('s" << id
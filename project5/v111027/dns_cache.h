@@ -0,0 +1,317 @@
+// dns_cache.h
+// SOCKS4A 的網域名稱查詢：自己送 UDP 查 A record，結果照 TTL 快取，查不到的也快取一小段時間；
+// 同一個名字同時有好幾個 request 在查時只送一次。
+// 沒有 nameserver、單一 label 的名字（localhost、search domain）或 UDP 查詢失敗時，
+// 改用 asio 的 resolver（getaddrinfo）。
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace dns {
+
+constexpr auto query_timeout = std::chrono::seconds(2);   // UDP 沒回應就改用系統 resolver
+constexpr auto negative_ttl  = std::chrono::seconds(30);  // 查不到的記多久
+constexpr auto min_ttl       = std::chrono::seconds(5);
+constexpr auto max_ttl       = std::chrono::hours(1);
+constexpr size_t max_entries = 4096;                      // 最多記幾個名字（hosts 檔的不算），超過就丟最久沒用的
+
+} // namespace dns
+
+class DnsCache {
+public:
+    using Addresses = std::vector<boost::asio::ip::address>;
+    using Handler = std::function<void(const boost::system::error_code&, const Addresses&)>;
+
+    explicit DnsCache(boost::asio::io_context& io)
+      : strand_(boost::asio::make_strand(io)), rng_(std::random_device{}())
+    {
+        load_nameserver("/etc/resolv.conf");
+    }
+
+    // /etc/hosts 格式的固定對應，永遠不會過期（離線測試用）
+    bool load_hosts(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream ls(line);
+            std::string ip, name;
+            if (!(ls >> ip)) continue;
+            boost::system::error_code ec;
+            auto addr = boost::asio::ip::make_address(ip, ec);
+            if (ec || !addr.is_v4()) continue;
+            while (ls >> name) {
+                Entry& e = cache_[lower(name)];
+                e.addrs.push_back(addr);
+                e.fixed = true;
+            }
+        }
+        return true;
+    }
+
+    // 只回傳 IPv4；handler 在 ex 上執行
+    void resolve(const std::string& name, boost::asio::any_io_executor ex, Handler handler) {
+        auto key = lower(name);
+        boost::asio::dispatch(strand_, [this, key, ex, handler]() {
+            auto it = cache_.find(key);
+            if (it == cache_.end()) {
+                it = cache_.emplace(key, Entry()).first;
+                lru_.push_front(key);
+                it->second.lru = lru_.begin();
+            } else if (!it->second.fixed) {
+                lru_.splice(lru_.begin(), lru_, it->second.lru);
+            }
+            Entry& e = it->second;
+            auto now = Clock::now();
+            if (!e.pending && (e.fixed || e.expires > now)) {
+                Addresses addrs = e.addrs;
+                boost::asio::post(ex, [handler, addrs]() {
+                    handler(addrs.empty() ? boost::asio::error::host_not_found
+                                          : boost::system::error_code(), addrs);
+                });
+                return;
+            }
+            e.waiters.push_back(Waiter{ex, handler});
+            if (e.pending) return;     // 已經有人在查了，等它的結果
+            e.pending = true;
+            if (nameserver_.port() != 0 && key.find('.') != std::string::npos)
+                query_udp(key);
+            else
+                query_system(key);
+        });
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Waiter {
+        boost::asio::any_io_executor ex;
+        Handler handler;
+    };
+
+    struct Entry {
+        Addresses addrs;               // 空的代表查不到（negative cache）
+        Clock::time_point expires;
+        bool fixed = false;            // 來自 hosts 檔
+        bool pending = false;
+        std::vector<Waiter> waiters;
+        std::list<std::string>::iterator lru;   // fixed 的不在 lru_ 裡
+    };
+
+    // 一次 UDP 查詢需要的東西，handler 之間共用
+    struct Query {
+        Query(boost::asio::any_io_executor ex) : socket(ex), timer(ex) {}
+        boost::asio::ip::udp::socket socket;
+        boost::asio::steady_timer timer;
+        std::vector<uint8_t> request;
+        std::array<uint8_t, 1500> response;
+        uint16_t id = 0;
+        bool done = false;
+    };
+
+    void load_nameserver(const std::string& path) {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            std::string key, ip;
+            if (!(ls >> key >> ip) || key != "nameserver") continue;
+            boost::system::error_code ec;
+            auto addr = boost::asio::ip::make_address(ip, ec);
+            if (ec || !addr.is_v4()) continue;
+            nameserver_ = boost::asio::ip::udp::endpoint(addr, 53);
+            return;
+        }
+    }
+
+    static std::string lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(),
+                       [](unsigned char c){ return std::tolower(c); });
+        return s;
+    }
+
+    void query_udp(const std::string& name) {
+        auto q = std::make_shared<Query>(strand_);
+        q->id = static_cast<uint16_t>(rng_());
+        if (!build_query(name, q->id, q->request)) { query_system(name); return; }
+
+        // connect 過的 UDP socket 才收得到 ICMP port unreachable，nameserver 沒開時不用等 timeout
+        boost::system::error_code ec;
+        q->socket.connect(nameserver_, ec);
+        if (ec) { query_system(name); return; }
+
+        q->timer.expires_after(dns::query_timeout);
+        q->timer.async_wait([this, q, name](const boost::system::error_code& ec) {
+            if (ec || q->done) return;
+            q->done = true;
+            boost::system::error_code ignored;
+            q->socket.close(ignored);
+            query_system(name);        // 逾時就交給系統 resolver
+        });
+        q->socket.async_send(boost::asio::buffer(q->request),
+            [this, q, name](const boost::system::error_code& ec, size_t) {
+                if (ec) fail(q, name);
+                else    receive(q, name);
+            });
+    }
+
+    void receive(std::shared_ptr<Query> q, const std::string& name) {
+        q->socket.async_receive(boost::asio::buffer(q->response),
+            [this, q, name](const boost::system::error_code& ec, size_t n) {
+                if (q->done) return;
+                if (ec) { fail(q, name); return; }
+                Addresses addrs;
+                uint32_t ttl = 0;
+                int rcode = parse_response(q->response.data(), n, q->id, addrs, ttl);
+                if (rcode < 0) { receive(q, name); return; }   // 不是這次查詢的回覆
+                q->done = true;
+                q->timer.cancel();
+                boost::system::error_code ignored;
+                q->socket.close(ignored);
+                if (rcode == 0 && !addrs.empty()) {
+                    auto t = std::chrono::seconds(ttl);
+                    finish(name, addrs, std::max<Clock::duration>(dns::min_ttl,
+                                        std::min<Clock::duration>(t, dns::max_ttl)));
+                } else {
+                    // NXDOMAIN、沒有 A record、被截斷：讓系統 resolver 再確認一次
+                    query_system(name);
+                }
+            });
+    }
+
+    // 送不出去或被拒絕：不等 timeout，直接交給系統 resolver
+    void fail(std::shared_ptr<Query> q, const std::string& name) {
+        if (q->done) return;
+        q->done = true;
+        q->timer.cancel();
+        boost::system::error_code ignored;
+        q->socket.close(ignored);
+        query_system(name);
+    }
+
+    void query_system(const std::string& name) {
+        auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(strand_);
+        resolver->async_resolve(boost::asio::ip::tcp::v4(), name, "",
+            [this, resolver, name](const boost::system::error_code& ec, auto results) {
+                Addresses addrs;
+                if (!ec)
+                    for (auto& r : results) addrs.push_back(r.endpoint().address());
+                // getaddrinfo 不會告訴我們 TTL，用最短的
+                finish(name, addrs, addrs.empty() ? Clock::duration(dns::negative_ttl)
+                                                  : Clock::duration(dns::min_ttl));
+            });
+    }
+
+    void finish(const std::string& name, const Addresses& addrs, Clock::duration ttl) {
+        Entry& e = cache_[name];
+        e.addrs = addrs;
+        e.expires = Clock::now() + ttl;
+        e.pending = false;
+        auto waiters = std::move(e.waiters);
+        e.waiters.clear();
+        evict();
+        for (auto& w : waiters) {
+            auto handler = w.handler;
+            boost::asio::post(w.ex, [handler, addrs]() {
+                handler(addrs.empty() ? boost::asio::error::host_not_found
+                                      : boost::system::error_code(), addrs);
+            });
+        }
+    }
+
+    // 每個 client 送來的新名字都會佔一格（negative 的也是），所以 max_entries 是硬上限：
+    // 從最久沒用的開始丟，還在查的跳過（它們的 waiter 還在等）。
+    // 超出的只會是同時在查的那幾個，不用整個掃一遍
+    void evict() {
+        auto it = lru_.end();
+        while (lru_.size() > dns::max_entries && it != lru_.begin()) {
+            --it;
+            auto found = cache_.find(*it);
+            if (found->second.pending) continue;
+            cache_.erase(found);
+            it = lru_.erase(it);
+        }
+    }
+
+    // header + 一個 question（QTYPE=A, QCLASS=IN），RD=1
+    static bool build_query(const std::string& name, uint16_t id, std::vector<uint8_t>& out) {
+        out = { uint8_t(id >> 8), uint8_t(id), 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+        std::istringstream ss(name);
+        std::string label;
+        while (std::getline(ss, label, '.')) {
+            if (label.empty()) continue;
+            if (label.size() > 63) return false;
+            out.push_back(static_cast<uint8_t>(label.size()));
+            out.insert(out.end(), label.begin(), label.end());
+        }
+        out.push_back(0);
+        out.insert(out.end(), { 0, 1, 0, 1 });
+        return out.size() <= 512;
+    }
+
+    // 跳過一個（可能壓縮過的）名字
+    static bool skip_name(const uint8_t* p, size_t n, size_t& off) {
+        while (off < n) {
+            uint8_t len = p[off];
+            if (len == 0) { ++off; return true; }
+            if ((len & 0xC0) == 0xC0) { off += 2; return off <= n; }
+            off += 1 + len;
+        }
+        return false;
+    }
+
+    // 回傳 rcode；id 不對或格式錯誤回傳 -1。TC（截斷）當作失敗（rcode 2）
+    static int parse_response(const uint8_t* p, size_t n, uint16_t id,
+                              Addresses& addrs, uint32_t& ttl) {
+        if (n < 12 || ((p[0] << 8) | p[1]) != id || !(p[2] & 0x80)) return -1;
+        if (p[2] & 0x02) return 2;
+        int rcode = p[3] & 0x0F;
+        size_t qd = (p[4] << 8) | p[5], an = (p[6] << 8) | p[7];
+        size_t off = 12;
+        for (size_t i = 0; i < qd; ++i) {
+            if (!skip_name(p, n, off)) return -1;
+            off += 4;
+        }
+        ttl = UINT32_MAX;
+        for (size_t i = 0; i < an; ++i) {
+            if (!skip_name(p, n, off) || off + 10 > n) return -1;
+            uint16_t type = (p[off] << 8) | p[off + 1];
+            uint32_t t = (uint32_t(p[off + 4]) << 24) | (p[off + 5] << 16) |
+                         (p[off + 6] << 8) | p[off + 7];
+            uint16_t rdlen = (p[off + 8] << 8) | p[off + 9];
+            off += 10;
+            if (off + rdlen > n) return -1;
+            // CNAME 之類的略過，A record 本身就會在答案裡
+            if (type == 1 && rdlen == 4) {
+                boost::asio::ip::address_v4::bytes_type b = {{ p[off], p[off + 1], p[off + 2], p[off + 3] }};
+                addrs.push_back(boost::asio::ip::address_v4(b));
+                ttl = std::min(ttl, t);
+            }
+            off += rdlen;
+        }
+        return rcode;
+    }
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::ip::udp::endpoint nameserver_;     // port 0 = 沒有
+    std::mt19937 rng_;
+    std::map<std::string, Entry> cache_;
+    std::list<std::string> lru_;                    // 最近用過的在前面
+};
+
+#endif
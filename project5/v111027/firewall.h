@@ -0,0 +1,252 @@
+// firewall.h
+// socks.conf 只在啟動和 reload 時解析一次，之後每個 request 只做整數比對。
+//
+// 規則格式（由上而下，第一條符合的決定結果，都不符合就拒絕）：
+//   permit|deny c|b 140.113.*.*      每個 octet 是數字或 '*'
+//   permit|deny c|b 140.113.0.0/16   CIDR
+//   permit|deny c|b 2001:db8::/32    IPv6 只支援 CIDR（沒有 /len 就是單一位址）
+// IPv4 的規則不會套到 IPv6 的目的地（v4-mapped 除外），要放行 IPv6 得另外寫 "permit c ::/0"。
+// SOCKS5 UDP ASSOCIATE 的每個 datagram 用 c 的規則檢查目的地
+#ifndef FIREWALL_H
+#define FIREWALL_H
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// 以位址 bit 為 key 的二元 trie，Bytes = 4 是 IPv4。
+// 每個節點記住「prefix 剛好在這裡結束的規則」中最小的 index，
+// 查詢沿著位址走最多 Bytes*8 步，取路上最小的 index，也就是最前面符合的規則；不配置記憶體
+template <size_t Bytes>
+class PrefixTrie {
+public:
+    using Key = std::array<unsigned char, Bytes>;
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    PrefixTrie() : nodes_(1) {}
+
+    void insert(const Key& key, unsigned prefix_len, uint32_t rule) {
+        uint32_t n = 0;
+        for (unsigned i = 0; i < prefix_len; ++i) {
+            int bit = bit_at(key, i);
+            if (nodes_[n].child[bit] == 0) {
+                nodes_[n].child[bit] = static_cast<uint32_t>(nodes_.size());
+                nodes_.emplace_back();
+            }
+            n = nodes_[n].child[bit];
+        }
+        if (rule < nodes_[n].rule) nodes_[n].rule = rule;
+    }
+
+    uint32_t lookup(const Key& key) const {
+        uint32_t n = 0, best = nodes_[0].rule;
+        for (unsigned i = 0; i < Bytes * 8; ++i) {
+            n = nodes_[n].child[bit_at(key, i)];
+            if (n == 0) break;
+            if (nodes_[n].rule < best) best = nodes_[n].rule;
+        }
+        return best;
+    }
+
+private:
+    struct Node {
+        uint32_t child[2] = {0, 0};   // 0 = 沒有（root 不會是別人的 child）
+        uint32_t rule = none;
+    };
+
+    static int bit_at(const Key& key, unsigned i) {
+        return (key[i / 8] >> (7 - i % 8)) & 1;
+    }
+
+    std::vector<Node> nodes_;
+};
+
+//Firewall Rule: (addr & mask) == value
+struct FirewallRule {
+    bool permit;        // false = deny
+    bool isConnect;     // true=CONNECT, false=BIND
+    uint32_t value;
+    uint32_t mask;      // '*' 的 octet 是 0
+    std::shared_ptr<const std::regex> pattern; // 只有 "1*.2.3.4" 這種夾在數字裡的萬用字元才用
+    bool v6 = false;    // true 時只看 value6/prefix6
+    boost::asio::ip::address_v6::bytes_type value6{};
+    unsigned prefix6 = 0;
+
+    bool matches(uint32_t addr, const boost::asio::ip::address_v4& dest) const {
+        return pattern ? std::regex_match(dest.to_string(), *pattern)
+                       : (addr & mask) == value;
+    }
+};
+
+// 編譯好的整份規則。IPv6 規則一律是 prefix，放在另一棵 trie；IPv4 mask 是連續 prefix 的放進 trie；
+// 像 *.113.*.* 這種中間有洞的 mask 或 regex 規則數量少，照順序線性比對
+class FirewallRules {
+public:
+    void add(FirewallRule r) {
+        uint32_t index = static_cast<uint32_t>(rules_.size());
+        int c = r.isConnect ? 1 : 0;
+        uint32_t host_bits = ~r.mask;
+        if (r.v6) {
+            trie6_[c].insert(r.value6, r.prefix6, index);
+        } else if (!r.pattern && (host_bits & (host_bits + 1)) == 0) {
+            unsigned len = 0;
+            for (uint32_t m = r.mask; m; m <<= 1) ++len;
+            trie_[c].insert(boost::asio::ip::address_v4(r.value).to_bytes(), len, index);
+        } else {
+            linear_[c].push_back(index);
+        }
+        rules_.push_back(std::move(r));
+    }
+
+    size_t size() const { return rules_.size(); }
+
+    bool permits(bool isConnect, const boost::asio::ip::address& dest) const {
+        int c = isConnect ? 1 : 0;
+        if (dest.is_v6()) {
+            auto v6 = dest.to_v6();
+            if (v6.is_v4_mapped())
+                return permits(isConnect, boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, v6));
+            uint32_t best = trie6_[c].lookup(v6.to_bytes());
+            return best != PrefixTrie<16>::none && rules_[best].permit;
+        }
+        auto v4 = dest.to_v4();
+        uint32_t addr = v4.to_uint();
+        uint32_t best = trie_[c].lookup(v4.to_bytes());
+        // 線性的只需要看排在 trie 結果前面的
+        for (uint32_t index : linear_[c]) {
+            if (index >= best) break;
+            if (rules_[index].matches(addr, v4)) { best = index; break; }
+        }
+        return best != PrefixTrie<4>::none && rules_[best].permit;
+    }
+
+private:
+    std::vector<FirewallRule> rules_;      // index = 在檔案裡的順序
+    PrefixTrie<4> trie_[2];                // [isConnect]
+    PrefixTrie<16> trie6_[2];
+    std::vector<uint32_t> linear_[2];      // index 由小到大
+};
+
+using FirewallRulesPtr = std::shared_ptr<const FirewallRules>;
+
+// "140.113.*.*" 或 "140.113.0.0/16" -> value/mask；
+// 每個 octet 必須是 0-255 或單獨一個 '*'，CIDR 時不能有 '*'
+inline bool parse_ipv4_pattern(const std::string& pat, uint32_t& value, uint32_t& mask) {
+    std::string addr = pat;
+    int prefix = -1;
+    auto slash = pat.find('/');
+    if (slash != std::string::npos) {
+        std::string len = pat.substr(slash + 1);
+        if (len.empty() || len.size() > 2 ||
+            len.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        prefix = std::stoi(len);
+        if (prefix > 32) return false;
+        addr = pat.substr(0, slash);
+    }
+
+    std::istringstream ss(addr);
+    std::string octet;
+    int n = 0;
+    value = mask = 0;
+    while (std::getline(ss, octet, '.')) {
+        if (++n > 4 || octet.empty()) return false;
+        value <<= 8;
+        mask <<= 8;
+        if (octet == "*" && prefix < 0) continue;
+        if (octet.size() > 3 || octet.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        int v = std::stoi(octet);
+        if (v > 255) return false;
+        value |= v;
+        mask |= 0xFF;
+    }
+    if (n != 4) return false;
+    if (prefix >= 0) mask = prefix ? ~uint32_t(0) << (32 - prefix) : 0;
+    value &= mask;
+    return true;
+}
+
+// "2001:db8::/32" 或單一 IPv6 位址 -> bytes/prefix，prefix 以外的 bit 清成 0
+inline bool parse_ipv6_pattern(const std::string& pat, boost::asio::ip::address_v6::bytes_type& value,
+                               unsigned& prefix) {
+    std::string addr = pat;
+    prefix = 128;
+    auto slash = pat.find('/');
+    if (slash != std::string::npos) {
+        std::string len = pat.substr(slash + 1);
+        if (len.empty() || len.size() > 3 ||
+            len.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        prefix = std::stoi(len);
+        if (prefix > 128) return false;
+        addr = pat.substr(0, slash);
+    }
+    boost::system::error_code ec;
+    auto v6 = boost::asio::ip::make_address_v6(addr, ec);
+    if (ec) return false;
+    value = v6.to_bytes();
+    for (unsigned i = 0; i < 16; ++i) {
+        unsigned keep = prefix > i * 8 ? std::min(8u, prefix - i * 8) : 0;
+        value[i] &= static_cast<unsigned char>(0xFF00 >> keep);
+    }
+    return true;
+}
+
+// 解析 "permit|deny c|b <pattern>"，其他的行（註解、空行）略過；讀不到檔案回傳 nullptr
+inline FirewallRulesPtr load_firewall_rules(const std::string& file = "socks.conf") {
+    std::ifstream in(file);
+    if (!in) return nullptr;
+    auto rules = std::make_shared<FirewallRules>();
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream ls(line);
+        std::string action, cmd, pat;
+        if (!(ls >> action >> cmd >> pat)) continue;
+        if ((action != "permit" && action != "deny") || (cmd != "c" && cmd != "b")) continue;
+
+        if (pat.find(':') != std::string::npos) {
+            FirewallRule r{ action == "permit", cmd == "c", 0, 0, nullptr };
+            r.v6 = true;
+            if (parse_ipv6_pattern(pat, r.value6, r.prefix6)) rules->add(std::move(r));
+            continue;
+        }
+        if (pat.find_first_not_of("0123456789.*/") != std::string::npos) continue;
+
+        FirewallRule r{ action == "permit", cmd == "c", 0, 0, nullptr };
+        if (!parse_ipv4_pattern(pat, r.value, r.mask)) {
+            if (pat.find('/') != std::string::npos) continue;
+            // 舊格式允許 '*' 接在數字旁邊，保留原本 regex 的意思
+            std::string cre = "^" +
+                std::regex_replace(pat, std::regex(R"(\*)"), R"(\d+)") + "$";
+            r.pattern = std::make_shared<const std::regex>(cre);
+        }
+        rules->add(std::move(r));
+    }
+    return rules;
+}
+
+// 目前生效的規則。reload 時整份換掉（RCU）：request 拿到的是當下那份的 shared_ptr，
+// 用完之前不會被釋放，也不需要上鎖
+inline FirewallRulesPtr& firewall_slot() {
+    static FirewallRulesPtr rules = std::make_shared<const FirewallRules>();
+    return rules;
+}
+
+inline FirewallRulesPtr current_firewall() {
+    return std::atomic_load(&firewall_slot());
+}
+
+inline void install_firewall(FirewallRulesPtr rules) {
+    std::atomic_store(&firewall_slot(), std::move(rules));
+}
+
+#endif
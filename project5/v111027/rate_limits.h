@@ -0,0 +1,356 @@
+// rate_limits.h
+// relay 的限速和公平分配，設定跟防火牆一起寫在 socks.conf（同樣在 reload 時整份換掉）：
+//   limit ip   140.113.0.0/16 1M        每個 client IP 各自一個 bucket，每秒 1 MiB
+//   limit user alice 256K/1M            每個 userid（SOCKS4 userid / SOCKS5 username）各自一個，burst 1 MiB
+//   limit dest 10.0.0.0/8 10M           符合這條的目的地全部共用一個 bucket
+//   weight user alice 4                 bandwidth 的分配比重，預設 1
+//   bandwidth 100M                      全部 tunnel 共用的總頻寬，依 weight 公平分配
+// 速度單位是 bytes/s，K/M/G 是 1024 的次方；沒寫 burst 就是一秒的量。
+// 同一種（ip/user/dest）有多條符合時用第一條。
+// fork 模式下每個 child 各自計算，所以 limit ip/user/dest 和 bandwidth 都是「每條 tunnel 的 process」各自的上限；
+// 要對整台機器限速得用 --no-fork / --threads
+#ifndef RATE_LIMITS_H
+#define RATE_LIMITS_H
+
+#include "firewall.h"
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// 可以扣成負的 token bucket：先送，欠多少就等多久，速度平均下來還是 rate
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate, double burst)
+      : rate_(rate), burst_(burst), tokens_(burst), last_(Clock::now()) {}
+
+    // 扣掉 n，回傳要等多久 tokens 才回到 0
+    Clock::duration consume(size_t n) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refill();
+        tokens_ -= static_cast<double>(n);
+        return wait_locked(0);
+    }
+
+    // 夠 n 才扣，回傳 true；不夠回傳 false，wait 設成還要等多久。
+    // n 比 burst 大時 tokens 永遠到不了 n，改成 bucket 滿了就給，欠的跟 consume 一樣之後再還
+    bool try_take(size_t n, Clock::duration& wait) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refill();
+        double need = std::min(static_cast<double>(n), burst_);
+        if (tokens_ >= need) {
+            tokens_ -= static_cast<double>(n);
+            return true;
+        }
+        wait = wait_locked(need);
+        return false;
+    }
+
+    bool full() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return tokens_ >= burst_;
+    }
+
+private:
+    void refill() {
+        auto now = Clock::now();
+        tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+        last_ = now;
+    }
+
+    Clock::duration wait_locked(double need) const {
+        if (tokens_ >= need) return Clock::duration::zero();
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>((need - tokens_) / rate_));
+    }
+
+    mutable std::mutex mutex_;
+    double rate_, burst_, tokens_;
+    Clock::time_point last_;
+};
+
+// 限速的 tunnel 一次最多讀多少：排隊的單位越小，互動式的 tunnel 插隊時要等的越短
+constexpr size_t fair_quantum = 16 * 1024;
+
+// 全部 tunnel 共用 bandwidth：self-clocked fair queueing。
+// 每個 request 的 finish tag = max(目前的 virtual time, 這個 flow 上一個 finish) + bytes / weight，
+// 總頻寬有空時先送 finish 最小的，所以長期下來各 flow 拿到的頻寬跟 weight 成正比。
+// 閒置一陣子的 flow（互動式的 shell 一次只送幾十 bytes）從目前的 virtual time 起算，
+// tag 幾乎一定最小，大量傳輸塞滿頻寬時打字還是馬上送出去。
+// 每個 flow（一條 tunnel 的一個方向）同時最多只有一個 request
+class FairScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Flow {
+        unsigned weight = 1;
+        double finish = 0;                         // 上一個 request 的 finish tag
+        size_t want = 0;
+        boost::asio::any_io_executor ex;
+        std::function<void()> granted;
+    };
+    using FlowPtr = std::shared_ptr<Flow>;
+
+    explicit FairScheduler(boost::asio::io_context& ctx)
+      : strand_(boost::asio::make_strand(ctx)), timer_(strand_) {}
+
+    // rate = 0 表示不分配（socks.conf 沒有 bandwidth）；reload 時呼叫
+    void set_rate(double rate, double burst) {
+        boost::asio::dispatch(strand_, [this, rate, burst]{
+            bucket_ = rate > 0 ? std::make_unique<TokenBucket>(rate, burst) : nullptr;
+            enabled_ = rate > 0;
+            schedule();
+        });
+    }
+
+    bool enabled() const { return enabled_; }
+
+    FlowPtr open(unsigned weight) {
+        auto f = std::make_shared<Flow>();
+        f->weight = std::max(1u, weight);
+        return f;
+    }
+
+    // 輪到 f 而且總頻寬夠 n 時，在 ex 上呼叫 granted
+    void request(FlowPtr f, size_t n, boost::asio::any_io_executor ex, std::function<void()> granted) {
+        boost::asio::dispatch(strand_, [this, f, n, ex, granted]{
+            f->want = n;
+            f->ex = ex;
+            f->granted = granted;
+            f->finish = std::max(vtime_, f->finish) + static_cast<double>(n) / f->weight;
+            pending_.emplace(f->finish, f);
+            schedule();
+        });
+    }
+
+private:
+    void schedule() {
+        while (!pending_.empty()) {
+            auto it = pending_.begin();
+            Flow& f = *it->second;
+            Clock::duration wait;
+            if (bucket_ && !bucket_->try_take(f.want, wait)) {
+                arm(wait);
+                return;
+            }
+            vtime_ = it->first;
+            auto cb = std::move(f.granted);
+            f.granted = nullptr;
+            f.want = 0;
+            boost::asio::post(f.ex, cb);
+            pending_.erase(it);
+        }
+    }
+
+    void arm(Clock::duration wait) {
+        if (armed_) return;
+        armed_ = true;
+        timer_.expires_after(wait);
+        timer_.async_wait([this](boost::system::error_code){
+            armed_ = false;
+            schedule();
+        });
+    }
+
+    boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+    boost::asio::steady_timer timer_;
+    std::unique_ptr<TokenBucket> bucket_;
+    std::atomic<bool> enabled_{false};
+    bool armed_ = false;
+    double vtime_ = 0;                                 // 最近送出的 finish tag
+    std::multimap<double, FlowPtr> pending_;           // finish tag -> 等待中的 flow
+};
+
+// 位址樣式：IPv4 用 firewall.h 的 "140.113.*.*" / CIDR，IPv6 只有 CIDR
+struct AddrPattern {
+    bool v6 = false;
+    uint32_t value = 0, mask = 0;
+    boost::asio::ip::address_v6::bytes_type value6{};
+    unsigned prefix6 = 0;
+
+    bool parse(const std::string& pat) {
+        v6 = pat.find(':') != std::string::npos;
+        return v6 ? parse_ipv6_pattern(pat, value6, prefix6)
+                  : parse_ipv4_pattern(pat, value, mask);
+    }
+
+    bool matches(boost::asio::ip::address addr) const {
+        if (addr.is_v6() && addr.to_v6().is_v4_mapped())
+            addr = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, addr.to_v6());
+        if (addr.is_v4()) return !v6 && (addr.to_v4().to_uint() & mask) == value;
+        if (!v6) return false;
+        auto b = addr.to_v6().to_bytes();
+        for (unsigned i = 0; i < 16 && i * 8 < prefix6; ++i) {
+            unsigned keep = std::min(8u, prefix6 - i * 8);
+            if ((b[i] & static_cast<unsigned char>(0xFF00 >> keep)) != value6[i]) return false;
+        }
+        return true;
+    }
+};
+
+class RateLimits {
+public:
+    enum Kind { ip, user, dest };
+
+    // 一條 tunnel 要套用的 bucket 和 weight
+    struct Tunnel {
+        std::vector<std::shared_ptr<TokenBucket>> buckets;
+        unsigned weight = 1;
+    };
+
+    Tunnel lookup(const boost::asio::ip::address& client, const std::string& userid,
+                  const boost::asio::ip::address& target) const {
+        Tunnel t;
+        bool seen[3] = {false, false, false};
+        for (size_t i = 0; i < limits_.size(); ++i) {
+            const Rule& r = limits_[i];
+            if (seen[r.kind] || !matches(r, client, userid, target)) continue;
+            seen[r.kind] = true;
+            // ip/user 每個值各自一個 bucket；dest 整條規則共用一個
+            std::string key = std::to_string(i) + '|' +
+                (r.kind == ip ? client.to_string() : r.kind == user ? userid : std::string());
+            t.buckets.push_back(bucket(key, r));
+        }
+        for (const Rule& r : weights_) {
+            if (!matches(r, client, userid, target)) continue;
+            t.weight = static_cast<unsigned>(r.rate);
+            break;
+        }
+        return t;
+    }
+
+    double bandwidth() const { return bandwidth_; }
+    double bandwidth_burst() const { return bandwidth_burst_; }
+
+    // "10M" -> 10485760，"256K/1M" 的 burst 另外回傳；格式錯誤回傳 false
+    static bool parse_rate(const std::string& text, double& rate, double& burst) {
+        auto slash = text.find('/');
+        if (!parse_size(text.substr(0, slash), rate) || rate <= 0) return false;
+        burst = rate;
+        if (slash != std::string::npos && (!parse_size(text.substr(slash + 1), burst) || burst <= 0))
+            return false;
+        return true;
+    }
+
+    // socks.conf 裡 limit / weight / bandwidth 以外的行都略過（防火牆自己讀）
+    static std::shared_ptr<const RateLimits> load(const std::string& file = "socks.conf") {
+        std::ifstream in(file);
+        if (!in) return nullptr;
+        auto limits = std::make_shared<RateLimits>();
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream ls(line);
+            std::string word, kind, pat, value;
+            if (!(ls >> word)) continue;
+            if (word == "bandwidth" && (ls >> value)) {
+                double rate, burst;
+                if (!parse_rate(value, rate, burst)) continue;
+                limits->bandwidth_ = rate;
+                // 預設 burst 只給 20ms 的量，讓排隊發生在這裡而不是 kernel 的 socket buffer；
+                // 自己寫的 burst 至少要一次讀的量（fair_quantum），不然每次都得先欠
+                limits->bandwidth_burst_ = value.find('/') != std::string::npos
+                    ? std::max<double>(burst, fair_quantum)
+                    : std::max<double>(rate / 50, 4 * fair_quantum);
+                continue;
+            }
+            if ((word != "limit" && word != "weight") || !(ls >> kind >> pat >> value)) continue;
+            Rule r;
+            if (kind == "ip")        r.kind = ip;
+            else if (kind == "user") r.kind = user;
+            else if (kind == "dest") r.kind = dest;
+            else continue;
+            if (r.kind == user) r.user = pat;
+            else if (!r.addr.parse(pat)) continue;
+            if (word == "limit") {
+                if (!parse_rate(value, r.rate, r.burst)) continue;
+                limits->limits_.push_back(std::move(r));
+            } else {
+                int w = std::atoi(value.c_str());
+                if (w <= 0) continue;
+                r.rate = w;
+                limits->weights_.push_back(std::move(r));
+            }
+        }
+        return limits;
+    }
+
+private:
+    struct Rule {
+        Kind kind = ip;
+        AddrPattern addr;
+        std::string user;          // "*" = 任何 userid
+        double rate = 0, burst = 0;    // weight 的行 rate 就是 weight
+    };
+
+    static bool parse_size(const std::string& s, double& out) {
+        if (s.empty()) return false;
+        size_t end = 0;
+        try { out = std::stod(s, &end); } catch (...) { return false; }
+        std::string unit = s.substr(end);
+        if (unit == "K" || unit == "k")      out *= 1024;
+        else if (unit == "M" || unit == "m") out *= 1024 * 1024;
+        else if (unit == "G" || unit == "g") out *= 1024.0 * 1024 * 1024;
+        else if (!unit.empty()) return false;
+        return true;
+    }
+
+    static bool matches(const Rule& r, const boost::asio::ip::address& client,
+                        const std::string& userid, const boost::asio::ip::address& target) {
+        switch (r.kind) {
+            case ip:   return r.addr.matches(client);
+            case user: return r.user == "*" || r.user == userid;
+            case dest: return r.addr.matches(target);
+        }
+        return false;
+    }
+
+    // 同一個 key 共用 bucket；太多的時候把滿的（沒人在用、也沒欠）清掉
+    std::shared_ptr<TokenBucket> bucket(const std::string& key, const Rule& r) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& b = buckets_[key];
+        if (!b) b = std::make_shared<TokenBucket>(r.rate, r.burst);
+        auto result = b;
+        if (buckets_.size() > max_buckets) {
+            for (auto it = buckets_.begin(); it != buckets_.end(); ) {
+                if (it->second.use_count() == 1 && it->second->full()) it = buckets_.erase(it);
+                else ++it;
+            }
+        }
+        return result;
+    }
+
+    static constexpr size_t max_buckets = 4096;
+
+    std::vector<Rule> limits_, weights_;
+    double bandwidth_ = 0, bandwidth_burst_ = 0;
+    mutable std::mutex mutex_;
+    mutable std::map<std::string, std::shared_ptr<TokenBucket>> buckets_;
+};
+
+using RateLimitsPtr = std::shared_ptr<const RateLimits>;
+
+// 跟 firewall_slot 一樣 RCU：reload 時整份換掉，已經建好的 tunnel 繼續用舊的 bucket
+inline RateLimitsPtr& limits_slot() {
+    static RateLimitsPtr limits = std::make_shared<const RateLimits>();
+    return limits;
+}
+
+inline RateLimitsPtr current_limits() {
+    return std::atomic_load(&limits_slot());
+}
+
+inline void install_limits(RateLimitsPtr limits) {
+    std::atomic_store(&limits_slot(), std::move(limits));
+}
+
+#endif
@@ -2,73 +2,515 @@
 #include <boost/asio.hpp>
 #include <boost/array.hpp>
 #include <iostream>
-#include <fstream>
-#include <regex>
 #include <string>
 #include <vector>
 #include <array>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unistd.h>      // fork
 #include <sys/wait.h>    // waitpid
+#include <sys/resource.h> // setrlimit
+#include <fcntl.h>       // splice, pipe2
+#include <sys/socket.h>  // recvmmsg, sendmmsg
+#include <cstring>
+#include <deque>
+#include <map>
+#include <sys/inotify.h>
+#include "firewall.h"
+#include "dns_cache.h"
+#include "stats.h"
+#include "rate_limits.h"
 
 using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
 
-//Firewall Rule
-struct FirewallRule{
-    bool isConnect;  // true=CONNECT, false=BIND
-    std::regex pattern; // compiled from wildcard
-};
+// tunnel 建好之後用 splice 讓資料 socket -> pipe -> socket 不經過 user space；
+// --no-splice 或開 pipe 失敗時用原本的 buffer 複製
+bool use_splice = true;
 
-std::vector<FirewallRule> load_firewall_rules(const std::string& file="socks.conf") {
-    std::vector<FirewallRule> rules;
-    std::ifstream in(file);
-    std::string line;
-    std::regex rx(R"(permit\s+([cb])\s+([\d\.\*]+))");
-    while (std::getline(in, line)) {
-        std::smatch m;
-        if (std::regex_search(line, m, rx)) {
-            bool isC = (m[1] == "c");
-            std::string pat = m[2];
-            std::string cre = "^" +
-                std::regex_replace(pat, std::regex(R"(\*)"), R"(\d+)") +
-                "$";
-            rules.push_back({ isC, std::regex(cre) });
-        }
-    }
-    return rules;
-}
+// SOCKS4A 的網域名稱都經過這裡（main 裡建立）。fork 模式下每個 child 各自一份，
+// 只有 --hosts 的固定對應有用；--no-fork 時所有 session 共用快取
+DnsCache* dns_cache = nullptr;
+
+// SOCKS5 username/password（--auth 的檔案，每行 "user password"）；空的就是不用認證
+std::map<std::string, std::string> socks5_users;
+
+// CONNECT 同時試所有位址：先連第一個，connect_stagger 內沒結果（或失敗）就再開下一個（RFC 8305），
+// 最先連上的贏，其他的關掉；全部加起來最多等 connect_timeout（--connect-timeout）
+constexpr auto connect_stagger = std::chrono::milliseconds(250);
+std::chrono::milliseconds connect_timeout(10000);
+
+// BIND 回第一個 reply 之後，DST 那台最多等多久來連；沒來就回第二個 reply 拒絕
+constexpr auto bind_timeout = std::chrono::seconds(120);
 
-bool check_firewall(const std::vector<FirewallRule>& rules,
-                    bool isConnect,
-                    const std::string& dest_ip) {
-    for (auto& r : rules)
-        if (r.isConnect == isConnect && std::regex_match(dest_ip, r.pattern))
-            return true;
-    return false;
+// UDP ASSOCIATE：一次 recvmmsg/sendmmsg 最多處理 udp_batch 個 datagram，
+// 每個 datagram 佔 udp_slot bytes，前面留 udp_headroom 給 SOCKS5 的 UDP header（IPv6 最長 22 bytes）
+constexpr size_t udp_batch    = 16;
+constexpr size_t udp_slot     = 4096;
+constexpr size_t udp_headroom = 22;
+constexpr size_t splice_chunk  = 64 * 1024; // 一次最多搬多少進 pipe（預設 pipe 容量）
+constexpr int    splice_rounds = 16;        // 連續搬這麼多次就讓出 thread
+
+// 不 fork 時很多 session 會同時寫 log，一筆 request 的幾行要一起寫出去
+void log_request(const std::string& msg) {
+    static std::mutex m;
+    std::lock_guard<std::mutex> lock(m);
+    std::cout << msg << std::flush;
 }
 
-//Session: handle one client, SOCKS4/4A 
+// buffer 複製模式用的 relay buffer：4 KiB ~ 256 KiB 共 7 種大小，每條 thread 各自一份 free list。
+// session 只有在 socket 真的可讀時才拿 buffer，寫完就還，閒置的 tunnel 不佔記憶體
+class BufferPool {
+public:
+    static constexpr size_t min_size = 4 * 1024;
+    static constexpr size_t max_size = 256 * 1024;
+    static constexpr size_t keep_bytes = 4 * 1024 * 1024;   // 每種大小最多留這麼多在 free list
+
+    static char* acquire(size_t size) {
+        auto& list = local().free_[slot(size)];
+        if (list.empty()) return new char[size];
+        char* p = list.back();
+        list.pop_back();
+        return p;
+    }
+
+    static void release(char* p, size_t size) {
+        auto& list = local().free_[slot(size)];
+        if (list.size() * size >= keep_bytes) {
+            delete[] p;
+            return;
+        }
+        list.push_back(p);
+    }
+
+private:
+    static constexpr int slots = 7;    // 4K << 0 .. 4K << 6
+
+    ~BufferPool() {
+        for (int i = 0; i < slots; ++i)
+            for (char* p : free_[i]) delete[] p;
+    }
+
+    static int slot(size_t size) {
+        int i = 0;
+        while ((min_size << i) < size) ++i;
+        return i;
+    }
+
+    static BufferPool& local() {
+        static thread_local BufferPool pool;
+        return pool;
+    }
+
+    std::vector<char*> free_[slots];
+};
+
+// buffer 複製時一個方向的狀態：每次讀滿就把 buffer 加倍，讀不到 1/4 就減半
+struct CopyDir {
+    size_t size = BufferPool::min_size;
+    bool   bulk = false;    // 已經長到最大，socket buffer 也調大了
+};
+
+// splice 一個方向用的 pipe；pending 是已經進 pipe、還沒送出去的 bytes
+struct SplicePipe {
+    int    fd[2] = {-1, -1};
+    size_t pending = 0;
+    bool   eof = false;
+
+    bool open() { return fd[0] >= 0 || pipe2(fd, O_NONBLOCK | O_CLOEXEC) == 0; }
+    ~SplicePipe() {
+        if (fd[0] >= 0) { ::close(fd[0]); ::close(fd[1]); }
+    }
+};
+
+// --pool ADDR:PORT[,N]：對常用的上游（例如 proxy 後面的 np_single_proc）先連好 N 條閒置連線，
+// CONNECT 的目的地剛好是其中之一就直接拿一條來用，拿走之後在背景補回去。
+// 只在 --no-fork 時有用：fork 出去的 child 沒辦法把用掉的連線還給 parent 補
+class ConnectionPool {
+public:
+    static constexpr size_t default_size = 4;
+
+    explicit ConnectionPool(boost::asio::io_context& ctx) : ctx_(ctx) {}
+
+    void add(const tcp::endpoint& ep, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            upstreams_[ep].want = size;
+        }
+        refill(ep);
+    }
+
+    // 有還活著的閒置連線就交給 out（fd 換到 out 的 executor 底下），回傳 true
+    bool take(const tcp::endpoint& ep, tcp::socket& out) {
+        std::unique_ptr<tcp::socket> s;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = upstreams_.find(ep);
+            if (it == upstreams_.end()) return false;
+            auto& idle = it->second.idle;
+            while (!idle.empty() && !s) {
+                s = std::move(idle.front());
+                idle.pop_front();
+                if (!alive(*s)) s.reset();
+            }
+        }
+        refill(ep);
+        if (!s) return false;
+        boost::system::error_code ec;
+        int fd = s->release(ec);
+        if (!ec) out.assign(ep.protocol(), fd, ec);
+        if (ec) { ::close(fd); return false; }
+        return true;
+    }
+
+private:
+    struct Upstream {
+        size_t want = 0;
+        size_t connecting = 0;
+        std::deque<std::unique_ptr<tcp::socket>> idle;
+    };
+
+    // 對方關掉（EOF）或出錯的不能用；有資料（例如 shell 的歡迎訊息）沒關係，relay 開始後會送給 client
+    static bool alive(tcp::socket& s) {
+        char c;
+        ssize_t n = ::recv(s.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    // 補到 want 條；連不上就等一秒再試，不要一直打一個掛掉的上游
+    void refill(const tcp::endpoint& ep) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Upstream& u = upstreams_[ep];
+        while (u.idle.size() + u.connecting < u.want) {
+            ++u.connecting;
+            auto s = std::make_shared<tcp::socket>(ctx_);
+            s->async_connect(ep, [this, ep, s](boost::system::error_code ec){
+                if (!ec) {
+                    s->set_option(tcp::no_delay(true), ec);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    Upstream& u = upstreams_[ep];
+                    --u.connecting;
+                    u.idle.push_back(std::make_unique<tcp::socket>(std::move(*s)));
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    --upstreams_[ep].connecting;
+                }
+                auto t = std::make_shared<boost::asio::steady_timer>(ctx_, std::chrono::seconds(1));
+                t->async_wait([this, ep, t](boost::system::error_code){ refill(ep); });
+            });
+        }
+    }
+
+    boost::asio::io_context& ctx_;
+    std::mutex mutex_;
+    std::map<tcp::endpoint, Upstream> upstreams_;
+};
+
+ConnectionPool* connection_pool = nullptr;   // 沒有 --pool 或 fork 模式就是 nullptr
+
+// socks.conf 的 bandwidth，main 裡建立；沒設定時 enabled() 是 false
+FairScheduler* fair_scheduler = nullptr;
+
+// SOCKS5 UDP ASSOCIATE 的 relay：面向 client 一個 socket，往外 IPv4 / IPv6 各一個（用到才開）。
+// 可讀時一次 recvmmsg 收一批，整批 sendmmsg 出去；送不出去（EAGAIN）、太大或分段的 datagram 直接丟掉，
+// UDP 本來就允許掉封包。buffer 跟 TCP relay 一樣可讀時才跟 BufferPool 拿
+class UdpRelay : public std::enable_shared_from_this<UdpRelay> {
+public:
+    UdpRelay(const boost::asio::any_io_executor& ex, const boost::asio::ip::address& peer,
+             const udp::endpoint& hint)
+      : client_(ex), remote4_(ex), remote6_(ex), peer_(peer), client_ep_(hint) {}
+
+    // client 只能從 TCP 連線的同一個 IP 送；hint 的 port 是 0 時用第一個 datagram 的來源
+    udp::endpoint open(const boost::asio::ip::address& local, boost::system::error_code& ec) {
+        client_.open(local.is_v6() ? udp::v6() : udp::v4(), ec);
+        if (!ec) client_.bind(udp::endpoint(local, 0), ec);
+        if (!ec) client_.non_blocking(true, ec);
+        if (ec) return udp::endpoint();
+        if (client_ep_.address().is_unspecified())
+            client_ep_ = udp::endpoint(peer_, client_ep_.port());
+        return client_.local_endpoint(ec);
+    }
+
+    void start() { pump_client(); }
+
+    // 兩個方向總共送出去的 bytes（payload，不含 SOCKS5 header）
+    uint64_t bytes() const { return bytes_; }
+
+    void close() {
+        boost::system::error_code ignored;
+        client_.close(ignored);
+        remote4_.close(ignored);
+        remote6_.close(ignored);
+    }
+
+private:
+    // 往外的 socket 第一次用到才開，同時開始收回來的封包
+    udp::socket* remote(bool v6) {
+        udp::socket& s = v6 ? remote6_ : remote4_;
+        if (!s.is_open()) {
+            boost::system::error_code ec;
+            s.open(v6 ? udp::v6() : udp::v4(), ec);
+            if (!ec) s.non_blocking(true, ec);
+            if (ec) { s.close(ec); return nullptr; }
+            pump_remote(s);
+        }
+        return &s;
+    }
+
+    // client -> 目的地：拆掉 header，檢查防火牆，依位址種類分兩批送
+    void pump_client() {
+        auto self = shared_from_this();
+        client_.async_wait(udp::socket::wait_read, [this,self](auto ec){
+            if (ec) return;
+            char* buf = BufferPool::acquire(udp_batch * udp_slot);
+            mmsghdr in[udp_batch];
+            iovec iov[udp_batch];
+            udp::endpoint from[udp_batch];
+            int n = receive(client_, buf, 0, in, iov, from);
+            if (n < 0) { BufferPool::release(buf, udp_batch * udp_slot); return; }
+
+            mmsghdr out[2][udp_batch];
+            iovec oiov[2][udp_batch];
+            udp::endpoint to[2][udp_batch];
+            unsigned count[2] = {0, 0};
+            auto rules = current_firewall();
+            for (int i = 0; i < n; ++i) {
+                if (in[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+                if (from[i].address() != peer_) continue;
+                if (client_ep_.port() == 0) client_ep_ = from[i];
+                else if (from[i] != client_ep_) continue;
+
+                const uint8_t* p = reinterpret_cast<const uint8_t*>(buf + i * udp_slot);
+                size_t len = in[i].msg_len;
+                if (len < 4 || p[0] || p[1] || p[2]) continue;   // RSV 不是 0 或有 FRAG
+                udp::endpoint dest;
+                size_t hdr;
+                if (p[3] == 1 && len >= 10) {
+                    boost::asio::ip::address_v4::bytes_type b;
+                    std::memcpy(b.data(), p + 4, 4);
+                    dest = udp::endpoint(boost::asio::ip::address_v4(b), (p[8] << 8) | p[9]);
+                    hdr = 10;
+                } else if (p[3] == 4 && len >= 22) {
+                    boost::asio::ip::address_v6::bytes_type b;
+                    std::memcpy(b.data(), p + 4, 16);
+                    dest = udp::endpoint(boost::asio::ip::address_v6(b), (p[20] << 8) | p[21]);
+                    hdr = 22;
+                } else if (p[3] == 3 && len >= 5u + p[4] + 2) {
+                    send_by_name(p, len);
+                    continue;
+                } else {
+                    continue;
+                }
+                if (!rules->permits(true, dest.address())) continue;
+                int f = dest.address().is_v6() ? 1 : 0;
+                unsigned k = count[f]++;
+                to[f][k] = dest;
+                oiov[f][k] = { const_cast<uint8_t*>(p + hdr), len - hdr };
+                std::memset(&out[f][k], 0, sizeof(mmsghdr));
+                out[f][k].msg_hdr.msg_name = to[f][k].data();
+                out[f][k].msg_hdr.msg_namelen = to[f][k].size();
+                out[f][k].msg_hdr.msg_iov = &oiov[f][k];
+                out[f][k].msg_hdr.msg_iovlen = 1;
+            }
+            for (int f = 0; f < 2; ++f) {
+                if (count[f] == 0) continue;
+                if (udp::socket* s = remote(f == 1)) {
+                    int sent = ::sendmmsg(s->native_handle(), out[f], count[f], MSG_DONTWAIT);
+                    count_sent(0, oiov[f], sent, 0);
+                }
+            }
+            BufferPool::release(buf, udp_batch * udp_slot);
+            pump_client();
+        });
+    }
+
+    // ATYP=3：查完 DNS 再單獨送這一個 datagram
+    void send_by_name(const uint8_t* p, size_t len) {
+        size_t name_len = p[4];
+        std::string name(reinterpret_cast<const char*>(p + 5), name_len);
+        uint16_t port = (p[5 + name_len] << 8) | p[6 + name_len];
+        auto payload = std::make_shared<std::string>(
+            reinterpret_cast<const char*>(p + 7 + name_len), len - 7 - name_len);
+        auto self = shared_from_this();
+        dns_cache->resolve(name, client_.get_executor(),
+            [this,self,port,payload](const boost::system::error_code& ec, const DnsCache::Addresses& addrs){
+                if (ec || !client_.is_open()) return;
+                udp::endpoint dest(addrs.front(), port);
+                if (!current_firewall()->permits(true, dest.address())) return;
+                if (udp::socket* s = remote(dest.address().is_v6())) {
+                    boost::system::error_code ec2;
+                    s->send_to(boost::asio::buffer(*payload), dest, 0, ec2);
+                    if (!ec2) {
+                        iovec v = { &(*payload)[0], payload->size() };
+                        count_sent(0, &v, 1, 0);
+                    }
+                }
+            });
+    }
+
+    // 目的地 -> client：在 payload 前面補上 header（寫在預留的 headroom 裡），整批送回 client
+    void pump_remote(udp::socket& s) {
+        auto self = shared_from_this();
+        s.async_wait(udp::socket::wait_read, [this,self,&s](auto ec){
+            if (ec) return;
+            char* buf = BufferPool::acquire(udp_batch * udp_slot);
+            mmsghdr in[udp_batch];
+            iovec iov[udp_batch];
+            udp::endpoint from[udp_batch];
+            int n = receive(s, buf, udp_headroom, in, iov, from);
+            if (n < 0) { BufferPool::release(buf, udp_batch * udp_slot); return; }
+
+            mmsghdr out[udp_batch];
+            iovec oiov[udp_batch];
+            unsigned count = 0;
+            for (int i = 0; i < n && client_ep_.port() != 0; ++i) {
+                if (in[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+                uint8_t* payload = reinterpret_cast<uint8_t*>(buf + i * udp_slot + udp_headroom);
+                auto addr = from[i].address();
+                size_t hdr = addr.is_v6() ? 22 : 10;
+                uint8_t* h = payload - hdr;
+                h[0] = h[1] = h[2] = 0;
+                if (addr.is_v6()) {
+                    h[3] = 4;
+                    auto b = addr.to_v6().to_bytes();
+                    std::memcpy(h + 4, b.data(), 16);
+                } else {
+                    h[3] = 1;
+                    auto b = addr.to_v4().to_bytes();
+                    std::memcpy(h + 4, b.data(), 4);
+                }
+                h[hdr - 2] = uint8_t(from[i].port() >> 8);
+                h[hdr - 1] = uint8_t(from[i].port() & 0xFF);
+                oiov[count] = { h, hdr + in[i].msg_len };
+                std::memset(&out[count], 0, sizeof(mmsghdr));
+                out[count].msg_hdr.msg_name = client_ep_.data();
+                out[count].msg_hdr.msg_namelen = client_ep_.size();
+                out[count].msg_hdr.msg_iov = &oiov[count];
+                out[count].msg_hdr.msg_iovlen = 1;
+                ++count;
+            }
+            if (count > 0) {
+                int sent = ::sendmmsg(client_.native_handle(), out, count, MSG_DONTWAIT);
+                count_sent(1, oiov, sent, addr_header_bytes(out, sent));
+            }
+            BufferPool::release(buf, udp_batch * udp_slot);
+            pump_remote(s);
+        });
+    }
+
+    // dir 0 = client -> 目的地；header 是送回 client 時加上去的 bytes，不算進流量
+    void count_sent(int dir, const iovec* iov, int sent, size_t header) {
+        if (sent <= 0) return;
+        size_t n = 0;
+        for (int i = 0; i < sent; ++i) n += iov[i].iov_len;
+        n -= header;
+        bytes_ += n;
+        Stats& st = Stats::instance();
+        Stats::add(st.datagrams[dir], sent);
+        Stats::add(st.bytes[dir], n);
+    }
+
+    static size_t addr_header_bytes(const mmsghdr* out, int sent) {
+        size_t n = 0;
+        for (int i = 0; i < sent; ++i) {
+            const uint8_t* h = static_cast<const uint8_t*>(out[i].msg_hdr.msg_iov->iov_base);
+            n += h[3] == 4 ? 22 : 10;
+        }
+        return n;
+    }
+
+    // 每個 slot 從 offset 開始收；回傳收到幾個，-1 表示 socket 壞了。
+    // EAGAIN（被別人先讀走）回傳 0，呼叫的人照常再等下一次可讀
+    static int receive(udp::socket& s, char* buf, size_t offset, mmsghdr* in,
+                       iovec* iov, udp::endpoint* from) {
+        for (size_t i = 0; i < udp_batch; ++i) {
+            iov[i] = { buf + i * udp_slot + offset, udp_slot - offset };
+            std::memset(&in[i], 0, sizeof(mmsghdr));
+            in[i].msg_hdr.msg_name = from[i].data();
+            in[i].msg_hdr.msg_namelen = from[i].capacity();
+            in[i].msg_hdr.msg_iov = &iov[i];
+            in[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = ::recvmmsg(s.native_handle(), in, udp_batch, MSG_DONTWAIT, nullptr);
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        for (int i = 0; i < n; ++i) from[i].resize(in[i].msg_hdr.msg_namelen);
+        return n;
+    }
+
+    udp::socket                 client_, remote4_, remote6_;
+    boost::asio::ip::address    peer_;       // TCP 控制連線的 client IP
+    udp::endpoint               client_ep_;  // 回給 client 的位址，port 0 = 還不知道
+    uint64_t                    bytes_ = 0;
+};
+
+//Session: handle one client, SOCKS4/4A/5
+// ex: fork 模式就是 io_context 本身；不 fork 時每個 session 一個 strand，多 thread 也不用上鎖
 class Session : public std::enable_shared_from_this<Session> {
 public:
-    static std::shared_ptr<Session> create(boost::asio::io_context& ctx) {
-        return std::shared_ptr<Session>(new Session(ctx));
+    static std::shared_ptr<Session> create(const boost::asio::any_io_executor& ex) {
+        return std::shared_ptr<Session>(new Session(ex));
     }
     tcp::socket& socket() { return client_sock_; }
-    void start() { read_header(); }
+    // client 在 accept 之後馬上 reset 的話拿不到位址，直接結束；之後一律用 client_ep_，
+    // 不再呼叫會丟 exception 的 remote_endpoint()（不 fork 時會把整個 server 帶走）
+    void start() {
+        boost::system::error_code ec;
+        client_ep_ = client_sock_.remote_endpoint(ec);
+        if (ec) {
+            client_sock_.close(ec);
+            return;
+        }
+        started_ = true;
+        Stats::add(Stats::instance().sessions_active, 1);
+        read_header();
+    }
+
+    // fork 模式下 parent 手上那份沒有 start 過，不算
+    ~Session() {
+        if (!started_) return;
+        Stats& st = Stats::instance();
+        Stats::add(st.sessions_active, -1);
+        if (tunnel_start_ == Clock::time_point()) return;
+        Stats::add(st.tunnels_active, -1);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - tunnel_start_);
+        st.tunnel_duration.observe(ms.count(), stats_bounds::duration_ms);
+        uint64_t total = up_bytes_ + down_bytes_ + (udp_ ? udp_->bytes() : 0);
+        st.tunnel_bytes.observe(total, stats_bounds::tunnel_bytes);
+    }
 
 private:
-    explicit Session(boost::asio::io_context& ctx)
-      : client_sock_(ctx),
-        remote_sock_(ctx),
-        resolver_(ctx),
+    using Clock = std::chrono::steady_clock;
+
+    explicit Session(const boost::asio::any_io_executor& ex)
+      : client_sock_(ex),
+        remote_sock_(ex),
+        stagger_(ex),
+        connect_deadline_(ex),
+        bind_deadline_(ex),
         bind_acceptor_(nullptr),
-        socks4a_(false)
+        socks4a_(false),
+        buf_(new boost::asio::streambuf)
     {}
 
-    void read_header() { //VN(1byte), CD(1byte), DSTPORT(2bytes), DSTIP(4bytes)
+    // 第一個 byte 決定版本：4 是 SOCKS4/4A，5 是 SOCKS5，其他的直接斷線
+    void read_header() {
         auto self = shared_from_this();
         boost::asio::async_read(client_sock_,
-            boost::asio::buffer(header_),
+            boost::asio::buffer(header_, 1),
+            [this,self](auto ec, auto){
+                if (ec) return;
+                if (header_[0] == 4)      read_socks4();
+                else if (header_[0] == 5) read_methods();
+            });
+    }
+
+    void read_socks4() { //VN(1byte), CD(1byte), DSTPORT(2bytes), DSTIP(4bytes)
+        auto self = shared_from_this();
+        boost::asio::async_read(client_sock_,
+            boost::asio::buffer(header_.data() + 1, header_.size() - 1),
             [this,self](auto ec, auto){
                 if (!ec) parse_header();
             });
@@ -85,10 +527,10 @@ private:
 
     void read_userid() {
         auto self = shared_from_this();
-        boost::asio::async_read_until(client_sock_, buf_, '\0',
+        boost::asio::async_read_until(client_sock_, *buf_, '\0',
             [this,self](auto ec, auto){
                 if (ec) return;
-                std::istream is(&buf_);
+                std::istream is(buf_.get());
                 std::getline(is, userid_, '\0');
                 if (socks4a_) read_domain();
                 else         resolve_and_handle();
@@ -97,36 +539,147 @@ private:
 
     void read_domain() {
         auto self = shared_from_this();
-        boost::asio::async_read_until(client_sock_, buf_, '\0',
+        boost::asio::async_read_until(client_sock_, *buf_, '\0',
             [this,self](auto ec, auto){
                 if (ec) return;
-                std::istream is(&buf_);
+                std::istream is(buf_.get());
                 std::getline(is, domain_, '\0');
                 resolve_and_handle();
             });
     }
 
+    // ---- SOCKS5（RFC 1928 / RFC 1929）----
+
+    // 讀剛好 n bytes 到 msg_，讀完才呼叫 next；讀不到就結束 session
+    template <class Next>
+    void read_exact(size_t n, Next next) {
+        msg_.resize(n);
+        auto self = shared_from_this();
+        boost::asio::async_read(client_sock_, boost::asio::buffer(msg_),
+            [this,self,next](auto ec, auto){
+                if (!ec) next();
+            });
+    }
+
+    // 寫完 bytes 才呼叫 next；ok=false 時寫完就斷線
+    template <class Next>
+    void write_then(std::vector<uint8_t> bytes, bool ok, Next next) {
+        auto data = std::make_shared<std::vector<uint8_t>>(std::move(bytes));
+        auto self = shared_from_this();
+        boost::asio::async_write(client_sock_, boost::asio::buffer(*data),
+            [this,self,data,ok,next](auto ec, auto){
+                if (ec || !ok) { client_sock_.close(ec); return; }
+                next();
+            });
+    }
+
+    // NMETHODS, METHODS：有設定帳號就只接受 0x02，否則只接受 0x00
+    void read_methods() {
+        version_ = 5;
+        read_exact(1, [this]{
+            read_exact(msg_[0], [this]{
+                uint8_t want = socks5_users.empty() ? 0x00 : 0x02;
+                bool ok = std::find(msg_.begin(), msg_.end(), want) != msg_.end();
+                if (!ok) Stats::instance().reject(Reject::auth);
+                write_then({ 5, ok ? want : uint8_t(0xFF) }, ok, [this,want]{
+                    if (want == 0x02) read_auth();
+                    else              read_request();
+                });
+            });
+        });
+    }
+
+    // VER(1) ULEN UNAME PLEN PASSWD；通過的 username 當作 userid
+    void read_auth() {
+        read_exact(2, [this]{
+            read_exact(msg_[1] + 1u, [this]{
+                userid_.assign(msg_.begin(), msg_.end() - 1);
+                read_exact(msg_.back(), [this]{
+                    std::string pass(msg_.begin(), msg_.end());
+                    auto it = socks5_users.find(userid_);
+                    bool ok = it != socks5_users.end() && it->second == pass;
+                    if (!ok) Stats::instance().reject(Reject::auth);
+                    write_then({ 1, uint8_t(ok ? 0 : 1) }, ok, [this]{ read_request(); });
+                });
+            });
+        });
+    }
+
+    // VER CMD RSV ATYP DST.ADDR DST.PORT
+    void read_request() {
+        read_exact(4, [this]{
+            command_ = msg_[1];
+            uint8_t atyp = msg_[3];
+            if (msg_[0] != 5) {
+                dest_ip_ = "?";
+                prepare_header();
+                reject(Reject::unsupported, 1);   // VER 不對：general failure
+                return;
+            }
+            if (atyp == 1 || atyp == 4) {
+                read_exact(atyp == 1 ? 6 : 18, [this,atyp]{
+                    size_t n = atyp == 1 ? 4 : 16;
+                    boost::asio::ip::address addr;
+                    if (atyp == 1) {
+                        boost::asio::ip::address_v4::bytes_type b;
+                        std::copy(msg_.begin(), msg_.begin() + 4, b.begin());
+                        addr = boost::asio::ip::address_v4(b);
+                    } else {
+                        boost::asio::ip::address_v6::bytes_type b;
+                        std::copy(msg_.begin(), msg_.begin() + 16, b.begin());
+                        addr = boost::asio::ip::address_v6(b);
+                    }
+                    dest_port_ = (msg_[n] << 8) | msg_[n + 1];
+                    ep_to_connect_ = tcp::endpoint(addr, dest_port_);
+                    resolve_and_handle();
+                });
+            } else if (atyp == 3) {
+                read_exact(1, [this]{
+                    read_exact(msg_[0] + 2u, [this]{
+                        domain_.assign(msg_.begin(), msg_.end() - 2);
+                        dest_port_ = (msg_[msg_.size() - 2] << 8) | msg_.back();
+                        // UDP ASSOCIATE 的位址只是 client 自己的來源提示，不用查
+                        if (command_ == 3) {
+                            ep_to_connect_ = tcp::endpoint(tcp::v4(), dest_port_);
+                            domain_.clear();
+                        }
+                        resolve_and_handle();
+                    });
+                });
+            } else {
+                dest_ip_ = "?";
+                prepare_header();
+                reject(Reject::unsupported, 8);   // address type not supported
+            }
+        });
+    }
+
     void resolve_and_handle() {
         // Build dest_ip_ early so header_msg_ can include it even on Reject
-        if (socks4a_) {
+        if (!domain_.empty()) {
             dest_ip_ = domain_;
-        } else {
+        } else if (version_ == 4) {
             dest_ip_ = std::to_string(ipb_[0])+"."+
                        std::to_string(ipb_[1])+"."+
                        std::to_string(ipb_[2])+"."+
                        std::to_string(ipb_[3]);
+            ep_to_connect_ = tcp::endpoint(
+                boost::asio::ip::make_address(dest_ip_), dest_port_);
+        } else {
+            dest_ip_ = ep_to_connect_.address().to_string();
         }
         prepare_header();
 
-        if (socks4a_) {
-            // async resolve domain
+        if (!domain_.empty()) {
+            // async resolve domain（先查快取）
             auto self = shared_from_this();
-            resolver_.async_resolve(domain_, std::to_string(dest_port_),
-                [this,self](auto ec, auto results){
-                    if (ec || results.empty()) {
-                        send_reply(91,"Reject");
+            dns_cache->resolve(domain_, client_sock_.get_executor(),
+                [this,self](const boost::system::error_code& ec, const DnsCache::Addresses& addrs){
+                    if (ec || addrs.empty()) {
+                        reject(Reject::resolve, 4);   // host unreachable
                     } else {
-                        ep_to_connect_ = (*results.begin()).endpoint();
+                        ep_to_connect_ = tcp::endpoint(addrs.front(), dest_port_);
+                        for (auto& a : addrs) candidates_.emplace_back(a, dest_port_);
                         // override dest_ip_ to actual IP in header
                         dest_ip_ = ep_to_connect_.address().to_string();
                         prepare_header(); 
@@ -134,32 +687,46 @@ private:
                     }
                 });
         } else {
-            ep_to_connect_ = tcp::endpoint(
-                boost::asio::ip::make_address(dest_ip_), dest_port_);
             handle_request();
         }
     }
 
     void prepare_header() {
-        std::string cmd = (command_==1 ? "CONNECT" : "BIND");
+        std::string cmd = (command_==1 ? "CONNECT" : command_==3 ? "UDP ASSOCIATE" : "BIND");
         header_msg_ =
-            "<S_IP>: "   + client_sock_.remote_endpoint().address().to_string() + "\n"
-          + "<S_PORT>: " + std::to_string(client_sock_.remote_endpoint().port())   + "\n"
+            "<S_IP>: "   + client_ep_.address().to_string()                     + "\n"
+          + "<S_PORT>: " + std::to_string(client_ep_.port())                    + "\n"
           + "<D_IP>: "   + dest_ip_                                             + "\n"
           + "<D_PORT>: " + std::to_string(dest_port_)                           + "\n"
           + "<Command>: " + cmd + "\n";
     }
 
     void handle_request() {
-        if (version_!=4 || (command_!=1 && command_!=2)) {
-            send_reply(91,"Reject");
+        bool known = command_==1 || command_==2 || (version_==5 && command_==3);
+        Stats::add(Stats::instance().requests[version_==5][known ? command_ - 1 : 3]);
+        if ((version_!=4 && version_!=5) || !known) {
+            reject(Reject::unsupported, 7);   // command not supported
+            return;
+        }
+        // UDP 的目的地每個 datagram 都不一樣，在 relay 裡才檢查
+        if (command_==3) {
+            do_udp_associate();
             return;
         }
 
-        auto rules = load_firewall_rules();
-        bool ok = check_firewall(rules, command_==1, dest_ip_);
+        // 規則在啟動 / reload 時就解析好了，這裡只拿目前那份來比對；
+        // CONNECT 只留下規則允許的位址
+        auto rules = current_firewall();
+        if (candidates_.empty()) candidates_.push_back(ep_to_connect_);
+        if (command_==1) {
+            candidates_.erase(std::remove_if(candidates_.begin(), candidates_.end(),
+                [&](const tcp::endpoint& ep){ return !rules->permits(true, ep.address()); }),
+                candidates_.end());
+        }
+        bool ok = command_==1 ? !candidates_.empty()
+                              : rules->permits(false, ep_to_connect_.address());
         if (!ok) {
-            send_reply(91,"Reject");
+            reject(Reject::firewall, 2);   // not allowed by ruleset
             return;
         }
 
@@ -168,99 +735,423 @@ private:
     }
 
     void do_connect() {
+        connect_begin_ = Clock::now();
+        if (connection_pool) {
+            for (auto& ep : candidates_) {
+                if (!connection_pool->take(ep, remote_sock_)) continue;
+                Stats::add(Stats::instance().pool_hits);
+                connected(ep);
+                return;
+            }
+        }
+
         auto self = shared_from_this();
-        remote_sock_.async_connect(ep_to_connect_,
-            [this,self](auto ec){
-                if (ec) send_reply(91,"Reject");
-                else {
-                    send_reply(90,"Accept");
-                    start_relay();
+        connect_deadline_.expires_after(connect_timeout);
+        connect_deadline_.async_wait([this,self](auto ec){
+            if (ec || connect_done_) return;
+            connect_failed(boost::asio::error::timed_out);
+        });
+        try_next_candidate();
+    }
+
+    // 開下一個位址的連線；這個如果 connect_stagger 內沒結果，計時器會再開下一個
+    void try_next_candidate() {
+        if (connect_done_ || next_candidate_ >= candidates_.size()) return;
+        auto self = shared_from_this();
+        size_t i = next_candidate_++;
+        attempts_.push_back(std::make_unique<tcp::socket>(client_sock_.get_executor()));
+        ++racing_;
+        attempts_.back()->async_connect(candidates_[i],
+            [this,self,i](auto ec){
+                --racing_;
+                if (connect_done_) return;
+                if (!ec) {
+                    connect_done_ = true;
+                    remote_sock_ = std::move(*attempts_[i]);
+                    stop_racing();
+                    connected(candidates_[i]);
+                    return;
                 }
+                // 失敗就不用等 stagger，馬上換下一個
+                if (next_candidate_ < candidates_.size()) try_next_candidate();
+                else if (racing_ == 0) connect_failed(ec);
             });
+        if (next_candidate_ < candidates_.size()) {
+            stagger_.expires_after(connect_stagger);
+            stagger_.async_wait([this,self](auto ec){
+                if (!ec) try_next_candidate();
+            });
+        }
+    }
+
+    void stop_racing() {
+        stagger_.cancel();
+        connect_deadline_.cancel();
+        boost::system::error_code ignored;
+        for (auto& s : attempts_) s->close(ignored);
+    }
+
+    void connect_failed(const boost::system::error_code& ec) {
+        connect_done_ = true;
+        stop_racing();
+        reject(Reject::connect, connect_error(ec));
+    }
+
+    void connected(const tcp::endpoint& ep) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - connect_begin_);
+        Stats::instance().connect_latency.observe(us.count(), stats_bounds::connect_us);
+        // log 記真正連上的那個位址
+        if (ep != ep_to_connect_) {
+            ep_to_connect_ = ep;
+            dest_ip_ = ep.address().to_string();
+            prepare_header();
+        }
+        boost::system::error_code ignored;
+        send_reply(true, 0, remote_sock_.local_endpoint(ignored));
+        start_relay();
+    }
+
+    // SOCKS5 REP：3 network / 4 host unreachable, 5 refused, 6 TTL expired，其他 1
+    static uint8_t connect_error(const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::network_unreachable) return 3;
+        if (ec == boost::asio::error::host_unreachable)    return 4;
+        if (ec == boost::asio::error::connection_refused)  return 5;
+        if (ec == boost::asio::error::timed_out)           return 6;
+        return 1;
     }
 
     void do_bind() {
+        // 等的是 DST 那台來連，所以跟 DST 用同一種位址
+        auto proto = ep_to_connect_.protocol();
+        boost::system::error_code ec;
         bind_acceptor_ = std::make_unique<tcp::acceptor>(client_sock_.get_executor());
-        bind_acceptor_->open(tcp::v4());
-        bind_acceptor_->set_option(tcp::acceptor::reuse_address(true));
-        bind_acceptor_->bind(tcp::endpoint(tcp::v4(), 0));  // port=0 → system allocate
-        bind_acceptor_->listen();
+        bind_acceptor_->open(proto, ec);
+        if (!ec) bind_acceptor_->set_option(tcp::acceptor::reuse_address(true), ec);
+        if (!ec) bind_acceptor_->bind(tcp::endpoint(proto, 0), ec);  // port=0 → system allocate
+        if (!ec) bind_acceptor_->listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec) {
+            reject(Reject::bind, 1);
+            return;
+        }
 
-        // port（host order）
-        uint16_t port = bind_acceptor_->local_endpoint().port();
+        // port（host order）；SOCKS4 的 IP 固定回 0.0.0.0，SOCKS5 回 client 連進來的那個位址
+        tcp::endpoint bound = bind_acceptor_->local_endpoint(ec);
+        if (proto == client_sock_.local_endpoint(ec).protocol())
+            bound.address(client_sock_.local_endpoint(ec).address());
 
-        //first reply, reply code=90，port use host-order，IP is 0.0.0.0
-        send_reply(90, "Accept", port);
-        // (send_reply: port>>8/port&0xFF change to network-order byte)
+        //first reply, reply code=90，port use host-order
+        send_reply(true, 0, bound);
 
-        // sync accept, wait remote
-        bind_acceptor_->accept(remote_sock_);
-        bind_acceptor_->close();
+        // async accept, wait remote；不 fork 時不能卡住整個 io_context。
+        // 時間到就關掉 acceptor，async_accept 會以 operation_aborted 結束
+        auto self = shared_from_this();
+        bind_deadline_.expires_after(bind_timeout);
+        bind_deadline_.async_wait([this,self](auto ec){
+            if (ec) return;
+            boost::system::error_code ignored;
+            bind_acceptor_->close(ignored);
+        });
+        bind_acceptor_->async_accept(remote_sock_,
+            [this,self,bound](auto ec){
+                bind_deadline_.cancel();
+                boost::system::error_code ignored;
+                bind_acceptor_->close(ignored);
+                if (ec) {
+                    reject(Reject::bind, 1);
+                    return;
+                }
+                // second response：SOCKS4 同一個 port，SOCKS5 回連進來的那台
+                send_reply(true, 0, version_==5 ? remote_sock_.remote_endpoint(ignored) : bound);
+                start_relay();
+            });
+    }
 
-        // second response, code + port
-        send_reply(90, "Accept", port);
+    // UDP relay 的生命跟 TCP 控制連線一樣長：連線斷了就關掉
+    void do_udp_associate() {
+        boost::system::error_code ec;
+        auto local = client_sock_.local_endpoint(ec);
+        udp_ = std::make_shared<UdpRelay>(client_sock_.get_executor(), client_ep_.address(),
+            udp::endpoint(ep_to_connect_.address(), ep_to_connect_.port()));
+        udp::endpoint bound = udp_->open(local.address(), ec);
+        if (ec) {
+            udp_.reset();
+            reject(Reject::bind, 1);
+            return;
+        }
+        send_reply(true, 0, tcp::endpoint(bound.address(), bound.port()));
+        tunnel_opened();
+        udp_->start();
+        watch_control();
+    }
 
-        // std::cout << header_msg_
-        //         << "<Reply>: Accept\n\n";
-        start_relay();
+    void watch_control() {
+        auto self = shared_from_this();
+        msg_.resize(256);
+        client_sock_.async_read_some(boost::asio::buffer(msg_),
+            [this,self](auto ec, size_t){
+                if (!ec) { watch_control(); return; }
+                udp_->close();
+                boost::system::error_code ignored;
+                client_sock_.close(ignored);
+            });
     }
 
-    void send_reply(uint8_t code, const std::string& txt,
-                    uint16_t port=0,
-                    const std::array<uint8_t,4>& ip={{0,0,0,0}})
-    {
-        std::array<uint8_t,8> rep{};
-        rep[0]=0; rep[1]=code;
-        rep[2]=uint8_t(port>>8);
-        rep[3]=uint8_t(port&0xFF);
-        for(int i=0;i<4;++i) rep[4+i]=ip[i];
+    void reject(Reject why, uint8_t rep5) {
+        Stats::instance().reject(why);
+        send_reply(false, rep5);
+    }
+
+    void tunnel_opened() {
+        tunnel_start_ = Clock::now();
+        Stats& st = Stats::instance();
+        Stats::add(st.tunnels_total);
+        Stats::add(st.tunnels_active, 1);
+    }
+
+    // relay 實際送出去的 bytes，同時記在這條 tunnel 和全域的計數器
+    void count_bytes(bool up, size_t n) {
+        (up ? up_bytes_ : down_bytes_) += n;
+        Stats::add(Stats::instance().bytes[up ? 0 : 1], n);
+    }
 
+    // SOCKS4：90 Accept / 91 Reject，只帶 port；SOCKS5：REP（0 成功，其他是失敗原因）+ 完整位址
+    void send_reply(bool accept, uint8_t rep5 = 1, const tcp::endpoint& bound = tcp::endpoint()) {
+        auto rep = std::make_shared<std::vector<uint8_t>>();
+        uint16_t port = bound.port();
+        if (version_ == 5) {
+            *rep = { 5, uint8_t(accept ? 0 : rep5), 0 };
+            if (bound.address().is_v6()) {
+                rep->push_back(4);
+                auto b = bound.address().to_v6().to_bytes();
+                rep->insert(rep->end(), b.begin(), b.end());
+            } else {
+                rep->push_back(1);
+                auto b = bound.address().to_v4().to_bytes();
+                rep->insert(rep->end(), b.begin(), b.end());
+            }
+            rep->push_back(uint8_t(port>>8));
+            rep->push_back(uint8_t(port&0xFF));
+        } else {
+            *rep = { 0, uint8_t(accept ? 90 : 91), uint8_t(port>>8), uint8_t(port&0xFF), 0, 0, 0, 0 };
+        }
+
+        std::string txt = accept ? "Accept" : "Reject";
         auto self = shared_from_this();
         boost::asio::async_write(client_sock_,
-            boost::asio::buffer(rep),
-            [this,self,txt](auto,auto){
-                std::cout<< header_msg_
-                         << "<Reply>: "<<txt<<"\n\n";
+            boost::asio::buffer(*rep),
+            [this,self,rep,txt](auto,auto){
+                log_request(header_msg_ + "<Reply>: " + txt + "\n\n");
+                boost::system::error_code ignored;
                 if(txt=="Reject")
-                    client_sock_.close();
+                    client_sock_.close(ignored);
             });
     }
     
     void start_relay() {
-        do_read_client();
-        do_read_remote();
+        tunnel_opened();
+        setup_limits();
+        // 互動式的 shell 一行一行送，不要等 Nagle
+        boost::system::error_code ignored;
+        client_sock_.set_option(tcp::no_delay(true), ignored);
+        remote_sock_.set_option(tcp::no_delay(true), ignored);
+
+        // async_read_until 可能多讀了 client 在收到 reply 前就送出的資料，先轉給對方
+        if (buf_->size() > 0) {
+            auto self = shared_from_this();
+            boost::asio::async_write(remote_sock_, buf_->data(),
+                [this,self](auto ec, size_t n){
+                    count_bytes(true, n);
+                    buf_.reset();
+                    if (ec) relay_abort();
+                    else    start_pumps();
+                });
+            return;
+        }
+        buf_.reset();   // 握手用完就不需要了
+        start_pumps();
     }
-    void do_read_client() {
+
+    void start_pumps() {
+        // 限速要先知道每次送多少，所以有限速的 tunnel 一律走 buffer 複製
+        if (use_splice && !limited_ && up_.open() && down_.open()) {
+            boost::system::error_code ec;
+            client_sock_.native_non_blocking(true, ec);
+            remote_sock_.native_non_blocking(true, ec);
+            if (!ec) {
+                splice_pump(client_sock_, remote_sock_, up_);
+                splice_pump(remote_sock_, client_sock_, down_);
+                return;
+            }
+        }
+        boost::system::error_code ec;
+        client_sock_.non_blocking(true, ec);
+        remote_sock_.non_blocking(true, ec);
+        copy_pump(client_sock_, remote_sock_, up_copy_);
+        copy_pump(remote_sock_, client_sock_, down_copy_);
+    }
+
+    // 一個方向：先把 pipe 裡的送完，再從來源搬下一批進 pipe；
+    // 哪一邊 EAGAIN 就等那一邊 ready。來源 EOF 且 pipe 清空後 shutdown 對方的寫端
+    void splice_pump(tcp::socket& from, tcp::socket& to, SplicePipe& p) {
         auto self = shared_from_this();
-        client_sock_.async_read_some(boost::asio::buffer(buf_c_),
-            [this,self](auto ec,size_t n){
-                if(!ec) {
-                    boost::asio::async_write(remote_sock_,
-                        boost::asio::buffer(buf_c_,n),
-                        [this,self](auto ec2,auto){
-                            if(!ec2) do_read_client();
+        for (int round = 0; round < splice_rounds; ++round) {
+            if (p.pending > 0) {
+                ssize_t n = ::splice(p.fd[0], nullptr, to.native_handle(), nullptr,
+                                     p.pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (n > 0) { p.pending -= n; count_bytes(&p == &up_, n); continue; }
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && errno == EAGAIN) {
+                    to.async_wait(tcp::socket::wait_write,
+                        [this,self,&from,&to,&p](auto ec){
+                            if (ec) relay_abort();
+                            else    splice_pump(from, to, p);
                         });
+                    return;
                 }
-            });
+                relay_abort();
+                return;
+            }
+            if (p.eof) {
+                boost::system::error_code ignored;
+                to.shutdown(tcp::socket::shutdown_send, ignored);
+                return;
+            }
+            ssize_t n = ::splice(from.native_handle(), nullptr, p.fd[1], nullptr,
+                                 splice_chunk, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) { p.pending += n; continue; }
+            if (n == 0) { p.eof = true; continue; }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                // pipe 這時是空的，EAGAIN 只可能是來源沒資料
+                from.async_wait(tcp::socket::wait_read,
+                    [this,self,&from,&to,&p](auto ec){
+                        if (ec) relay_abort();
+                        else    splice_pump(from, to, p);
+                    });
+                return;
+            }
+            relay_abort();
+            return;
+        }
+        // 一直有資料就讓出 thread，其他 session 也要跑
+        boost::asio::post(client_sock_.get_executor(),
+            [this,self,&from,&to,&p]{ splice_pump(from, to, p); });
+    }
+
+    // 任一邊出錯就兩邊都關，另一個方向的等待也會跟著結束
+    void relay_abort() {
+        boost::system::error_code ignored;
+        client_sock_.close(ignored);
+        remote_sock_.close(ignored);
+    }
+
+    // buffer 複製：對方 EOF 時只關掉另一邊的寫端，讓回應還能傳回來
+    void relay_eof(tcp::socket& to, const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::eof) {
+            boost::system::error_code ignored;
+            to.shutdown(tcp::socket::shutdown_send, ignored);
+        } else {
+            relay_abort();
+        }
     }
-    void do_read_remote() {
+
+    // socks.conf 的 limit / weight / bandwidth 在 tunnel 建立時決定，之後 reload 不影響這條
+    void setup_limits() {
+        auto t = current_limits()->lookup(client_ep_.address(), userid_, ep_to_connect_.address());
+        buckets_ = std::move(t.buckets);
+        if (fair_scheduler && fair_scheduler->enabled()) {
+            flows_[0] = fair_scheduler->open(t.weight);
+            flows_[1] = fair_scheduler->open(t.weight);
+        }
+        limited_ = !buckets_.empty() || flows_[0];
+    }
+
+    // 送 n bytes 之前：先扣這條 tunnel 的所有 bucket，欠最多的那個決定等多久，
+    // 再跟 bandwidth 的 scheduler 排隊；都通過才呼叫 next
+    template <class Next>
+    void throttle(int dir, size_t n, Next next) {
         auto self = shared_from_this();
-        remote_sock_.async_read_some(boost::asio::buffer(buf_r_),
-            [this,self](auto ec,size_t n){
-                if(!ec) {
-                    boost::asio::async_write(client_sock_,
-                        boost::asio::buffer(buf_r_,n),
-                        [this,self](auto ec2,auto){
-                            if(!ec2) do_read_remote();
-                        });
+        auto go = [this,self,dir,n,next]{
+            if (flows_[dir]) fair_scheduler->request(flows_[dir], n, client_sock_.get_executor(), next);
+            else             next();
+        };
+        TokenBucket::Clock::duration wait{};
+        for (auto& b : buckets_) wait = std::max(wait, b->consume(n));
+        if (wait <= TokenBucket::Clock::duration::zero()) { go(); return; }
+        if (!throttle_[dir])
+            throttle_[dir] = std::make_unique<boost::asio::steady_timer>(client_sock_.get_executor());
+        throttle_[dir]->expires_after(wait);
+        throttle_[dir]->async_wait([go](auto){ go(); });
+    }
+
+    // buffer 複製：等到可讀才跟 pool 拿 buffer，寫完就還回去
+    void copy_pump(tcp::socket& from, tcp::socket& to, CopyDir& d) {
+        auto self = shared_from_this();
+        from.async_wait(tcp::socket::wait_read,
+            [this,self,&from,&to,&d](auto ec){
+                if (ec) { relay_abort(); return; }
+                size_t size = d.size;
+                char* buf = BufferPool::acquire(size);
+                // 限速的 tunnel 一次最多讀一個 quantum，互動式的 tunnel 才不用等大塊的送完
+                size_t limit = limited_ ? std::min(size, fair_quantum) : size;
+                size_t n = from.read_some(boost::asio::buffer(buf, limit), ec);
+                if (ec == boost::asio::error::would_block) {
+                    BufferPool::release(buf, size);
+                    copy_pump(from, to, d);
+                    return;
                 }
+                if (ec) {
+                    BufferPool::release(buf, size);
+                    relay_eof(to, ec);
+                    return;
+                }
+                resize(from, to, d, n);
+                auto write = [this,self,&from,&to,&d,buf,size,n]{
+                    boost::asio::async_write(to, boost::asio::buffer(buf, n),
+                        [this,self,&from,&to,&d,buf,size](auto ec2, size_t n2){
+                            BufferPool::release(buf, size);
+                            count_bytes(&d == &up_copy_, n2);
+                            if (ec2) relay_abort();
+                            else     copy_pump(from, to, d);
+                        });
+                };
+                if (limited_) throttle(&d == &up_copy_ ? 0 : 1, n, write);
+                else          write();
             });
     }
 
+    // 大量傳輸的方向 buffer 慢慢加大，長到最大時再把兩端的 kernel socket buffer 調大
+    void resize(tcp::socket& from, tcp::socket& to, CopyDir& d, size_t n) {
+        if (n == d.size && d.size < BufferPool::max_size) {
+            d.size *= 2;
+        } else if (n < d.size / 4 && d.size > BufferPool::min_size) {
+            d.size /= 2;
+        }
+        if (d.size == BufferPool::max_size && !d.bulk) {
+            d.bulk = true;
+            boost::system::error_code ignored;
+            int want = static_cast<int>(BufferPool::max_size * 4);
+            tcp::socket::send_buffer_size snd;
+            to.get_option(snd, ignored);
+            if (snd.value() < want)
+                to.set_option(tcp::socket::send_buffer_size(want), ignored);
+            tcp::socket::receive_buffer_size rcv;
+            from.get_option(rcv, ignored);
+            if (rcv.value() < want)
+                from.set_option(tcp::socket::receive_buffer_size(want), ignored);
+        }
+    }
+
     tcp::socket                         client_sock_;
+    tcp::endpoint                       client_ep_;       // start() 時記下的 client 位址
     tcp::socket                         remote_sock_;
-    tcp::resolver                       resolver_;
     tcp::endpoint                       ep_to_connect_;
+    std::vector<tcp::endpoint>          candidates_;      // CONNECT 要試的位址，依序
+    std::vector<std::unique_ptr<tcp::socket>> attempts_;
+    size_t                              next_candidate_ = 0;
+    int                                 racing_ = 0;      // 還沒有結果的嘗試
+    bool                                connect_done_ = false;
+    boost::asio::steady_timer           stagger_, connect_deadline_, bind_deadline_;
     std::unique_ptr<tcp::acceptor>      bind_acceptor_;
     std::array<uint8_t,8>               header_;
     std::array<uint8_t,4>               ipb_;
@@ -268,59 +1159,349 @@ private:
     uint16_t                            dest_port_{};
     bool                                socks4a_;
     std::string                         userid_, domain_, dest_ip_, header_msg_;
-    boost::asio::streambuf              buf_;
-    std::array<char,4096>               buf_c_, buf_r_;
+    std::unique_ptr<boost::asio::streambuf> buf_;     // 只在握手時用
+    std::vector<uint8_t>                msg_;             // SOCKS5 握手一段一段讀
+    std::shared_ptr<UdpRelay>           udp_;
+    bool                                started_ = false;
+    Clock::time_point                   tunnel_start_;    // 預設值 = 還沒建立 tunnel
+    uint64_t                            up_bytes_ = 0, down_bytes_ = 0;
+    Clock::time_point                   connect_begin_;
+    bool                                limited_ = false;  // 有 limit 或 bandwidth 套用在這條
+    std::vector<std::shared_ptr<TokenBucket>> buckets_;
+    FairScheduler::FlowPtr              flows_[2];        // [up, down]
+    std::unique_ptr<boost::asio::steady_timer> throttle_[2];
+    CopyDir                             up_copy_, down_copy_;
+    SplicePipe                          up_, down_;   // client->remote, remote->client
 };
 
-// async server with fork 
+// socks.conf 改了就重新載入（防火牆規則和限速設定）：收到 SIGHUP，或 inotify 看到檔案被寫入 / 換掉。
+// 只在 parent 跑；fork 出去的 child 用 fork 當下的規則
+class FirewallReloader {
+public:
+    FirewallReloader(boost::asio::io_context& ctx, std::string file)
+      : file_(std::move(file)),
+        signals_(ctx, SIGHUP),
+        notify_(ctx)
+    {
+        reload();
+        wait_signal();
+
+        // 看整個目錄：編輯器常常是寫新檔再 rename 蓋過去
+        auto slash = file_.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : file_.substr(0, slash);
+        name_ = slash == std::string::npos ? file_ : file_.substr(slash + 1);
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) return;
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            ::close(fd);
+            return;
+        }
+        notify_.assign(fd);
+        wait_notify();
+    }
+
+    // child 不需要 reload，也不能把 inotify 的事件讀走
+    void close() {
+        boost::system::error_code ec;
+        signals_.clear(ec);
+        signals_.cancel(ec);
+        notify_.close(ec);
+    }
+
+private:
+    void reload() {
+        auto rules = load_firewall_rules(file_);
+        if (!rules) {
+            std::cerr << "firewall: cannot read " << file_ << ", keeping "
+                      << current_firewall()->size() << " rules\n";
+            return;
+        }
+        std::cerr << "firewall: " << rules->size() << " rules from " << file_ << "\n";
+        install_firewall(std::move(rules));
+
+        // 同一個檔案裡的 limit / weight / bandwidth
+        if (auto limits = RateLimits::load(file_)) {
+            if (fair_scheduler)
+                fair_scheduler->set_rate(limits->bandwidth(), limits->bandwidth_burst());
+            install_limits(std::move(limits));
+        }
+    }
+
+    void wait_signal() {
+        signals_.async_wait([this](auto ec, int){
+            if (ec) return;
+            reload();
+            wait_signal();
+        });
+    }
+
+    void wait_notify() {
+        notify_.async_read_some(boost::asio::buffer(events_),
+            [this](auto ec, size_t n){
+                if (ec) return;
+                bool hit = false;
+                for (size_t off = 0; off + sizeof(inotify_event) <= n; ) {
+                    auto* ev = reinterpret_cast<const inotify_event*>(events_.data() + off);
+                    if (ev->len && name_ == ev->name) hit = true;
+                    off += sizeof(inotify_event) + ev->len;
+                }
+                if (hit) reload();
+                wait_notify();
+            });
+    }
+
+    std::string                                 file_, name_;
+    boost::asio::signal_set                     signals_;
+    boost::asio::posix::stream_descriptor       notify_;
+    alignas(inotify_event) std::array<char,4096> events_;
+};
+
+// --stats PORT：只聽 127.0.0.1，GET /metrics（或 /）回傳 Stats 的內容，其他路徑 404。
+// 跟 FirewallReloader 一樣只在 parent 跑；計數器在共享記憶體，所以看得到所有 child 的數字
+class StatsServer {
+public:
+    StatsServer(boost::asio::io_context& ctx, unsigned short port)
+      : ctx_(ctx), acceptor_(ctx)
+    {
+        if (port == 0) return;
+        boost::system::error_code ec;
+        tcp::endpoint ep(boost::asio::ip::address_v4::loopback(), port);
+        acceptor_.open(ep.protocol(), ec);
+        if (!ec) acceptor_.set_option(tcp::acceptor::reuse_address(true), ec);
+        if (!ec) acceptor_.bind(ep, ec);
+        if (!ec) acceptor_.listen(boost::asio::socket_base::max_listen_connections, ec);
+        if (ec) {
+            std::cerr << "stats: cannot listen on port " << port << ": " << ec.message() << "\n";
+            acceptor_.close(ec);
+            return;
+        }
+        start_accept();
+    }
+
+    void close() {
+        boost::system::error_code ec;
+        acceptor_.close(ec);
+    }
+
+private:
+    struct Client {
+        explicit Client(boost::asio::io_context& ctx) : socket(ctx) {}
+        tcp::socket socket;
+        boost::asio::streambuf request;
+        std::string response;
+    };
+
+    void start_accept() {
+        auto c = std::make_shared<Client>(ctx_);
+        acceptor_.async_accept(c->socket, [this, c](boost::system::error_code ec){
+            if (ec == boost::asio::error::operation_aborted) return;
+            if (!ec) serve(c);
+            start_accept();
+        });
+    }
+
+    // 只看 request line，header 讀到空行為止就好，不支援 keep-alive
+    void serve(std::shared_ptr<Client> c) {
+        boost::asio::async_read_until(c->socket, c->request, "\r\n\r\n",
+            [c](boost::system::error_code ec, size_t){
+                if (ec) return;
+                std::istream is(&c->request);
+                std::string method, target;
+                is >> method >> target;
+                std::string body, status = "200 OK";
+                if (target == "/metrics" || target == "/") {
+                    body = Stats::instance().render();
+                } else {
+                    status = "404 Not Found";
+                    body = "not found\n";
+                }
+                c->response = "HTTP/1.1 " + status + "\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n";
+                if (method != "HEAD") c->response += body;
+                boost::asio::async_write(c->socket, boost::asio::buffer(c->response),
+                    [c](boost::system::error_code, size_t){
+                        boost::system::error_code ignored;
+                        c->socket.shutdown(tcp::socket::shutdown_both, ignored);
+                    });
+            });
+    }
+
+    boost::asio::io_context& ctx_;
+    tcp::acceptor            acceptor_;
+};
+
+// async server with fork；fork=false 時所有 session 都在這個 process 裡
 class Server{
 public:
-    Server(boost::asio::io_context& ctx, unsigned short port)
+    Server(boost::asio::io_context& ctx, unsigned short port, bool fork,
+           unsigned short stats_port)
       : io_ctx_(ctx),
-        acceptor_(ctx, tcp::endpoint(tcp::v4(), port))
+        acceptor_(ctx, tcp::endpoint(tcp::v4(), port)),
+        firewall_(ctx, "socks.conf"),
+        stats_(ctx, stats_port),
+        retry_timer_(ctx),
+        fork_(fork)
     {
         start_accept();
     }
 
 private:
     void start_accept(){
-        auto session = Session::create(io_ctx_);
-                acceptor_.async_accept(session->socket(),
+        if (!fork_) {
+            auto session = Session::create(boost::asio::make_strand(io_ctx_));
+            acceptor_.async_accept(session->socket(),
+                [this, session](boost::system::error_code ec){
+                    if (ec) { retry_accept(); return; }
+                    session->start();
+                    start_accept();
+                });
+            return;
+        }
+
+        auto session = Session::create(io_ctx_.get_executor());
+        acceptor_.async_accept(session->socket(),
             [this, session](boost::system::error_code ec){
                 if (!ec) {
                     io_ctx_.notify_fork(boost::asio::io_context::fork_prepare);
                     pid_t pid = fork();
                     if (pid > 0) {
                         io_ctx_.notify_fork(boost::asio::io_context::fork_parent);
-                        session->socket().close();
+                        session->socket().close(ec);
                         while (waitpid(-1, nullptr, WNOHANG) > 0) {}
                         start_accept();
                     }
                     else if (pid == 0) {
                         io_ctx_.notify_fork(boost::asio::io_context::fork_child);
-                        acceptor_.close();
+                        acceptor_.close(ec);
+                        firewall_.close();
+                        stats_.close();
                         session->start();
                     }
                 } else {
-                    start_accept();
+                    retry_accept();
                 }
             });
     }
 
-    boost::asio::io_context& io_ctx_;
-    tcp::acceptor            acceptor_;
+    // fd 用完（EMFILE）之類的錯誤馬上再 accept 只會空轉，等一下再試
+    void retry_accept() {
+        retry_timer_.expires_after(std::chrono::milliseconds(100));
+        retry_timer_.async_wait([this](boost::system::error_code ec){
+            if (!ec) start_accept();
+        });
+    }
+
+    boost::asio::io_context&  io_ctx_;
+    tcp::acceptor             acceptor_;
+    FirewallReloader          firewall_;
+    StatsServer               stats_;
+    boost::asio::steady_timer retry_timer_;
+    bool                      fork_;
 };
 
+// 一個 process 要撐很多 tunnel（每條兩個 fd），把 fd 上限拉到 hard limit
+void raise_fd_limit() {
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) return;
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+        std::cerr << "fd limit: " << rl.rlim_cur << "\n";
+}
+
 int main(int argc, char* argv[]) {
     signal(SIGCHLD, SIG_IGN);
-    if (argc!=2) {
-        std::cerr<<"Usage: "<<argv[0]<<" <port>\n";
+    // splice(2) 寫進對方已經關掉的 socket 沒有 MSG_NOSIGNAL 可用，不忽略的話 SIGPIPE 會殺掉整個 process
+    signal(SIGPIPE, SIG_IGN);
+    // --no-fork: 全部 session 在同一個 process；--threads N: 再用 N 條 thread 跑（隱含 --no-fork）
+    bool fork = true;
+    int threads = 1;
+    std::string hosts;
+    unsigned short stats_port = 0;
+    std::vector<std::pair<tcp::endpoint, size_t>> pools;
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; ++argi) {
+        std::string opt = argv[argi];
+        if (opt == "--no-fork") {
+            fork = false;
+        } else if (opt == "--no-splice") {
+            use_splice = false;
+        } else if (opt == "--threads" && argi + 1 < argc) {
+            fork = false;
+            threads = std::max(1, std::atoi(argv[++argi]));
+        } else if (opt == "--connect-timeout" && argi + 1 < argc) {
+            connect_timeout = std::chrono::milliseconds(
+                static_cast<long>(std::max(0.1, std::atof(argv[++argi])) * 1000));
+        } else if (opt == "--pool" && argi + 1 < argc) {
+            // ADDR:PORT[,N]，IPv6 寫成 [::1]:7001
+            std::string spec = argv[++argi];
+            size_t n = ConnectionPool::default_size;
+            auto comma = spec.find(',');
+            if (comma != std::string::npos) {
+                n = std::max(1, std::atoi(spec.c_str() + comma + 1));
+                spec.resize(comma);
+            }
+            auto colon = spec.rfind(':');
+            boost::system::error_code ec;
+            if (colon != std::string::npos) {
+                std::string host = spec.substr(0, colon);
+                if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+                    host = host.substr(1, host.size() - 2);
+                auto addr = boost::asio::ip::make_address(host, ec);
+                if (!ec) pools.emplace_back(tcp::endpoint(addr,
+                    static_cast<unsigned short>(std::atoi(spec.c_str() + colon + 1))), n);
+            }
+            if (colon == std::string::npos || ec) {
+                std::cerr << "pool: expected ADDR:PORT[,N], got " << argv[argi] << "\n";
+                return 1;
+            }
+        } else if (opt == "--stats" && argi + 1 < argc) {
+            stats_port = static_cast<unsigned short>(std::atoi(argv[++argi]));
+        } else if (opt == "--hosts" && argi + 1 < argc) {
+            hosts = argv[++argi];
+        } else if (opt == "--auth" && argi + 1 < argc) {
+            std::ifstream in(argv[++argi]);
+            if (!in) {
+                std::cerr << "auth: cannot read " << argv[argi] << "\n";
+                return 1;
+            }
+            std::string user, pass;
+            while (in >> user >> pass) socks5_users[user] = pass;
+        } else {
+            break;
+        }
+    }
+    if (argc - argi != 1) {
+        std::cerr<<"Usage: "<<argv[0]<<" [--no-fork] [--threads N] [--no-splice] [--hosts FILE] [--auth FILE] [--stats PORT]\n"
+                 <<"       [--connect-timeout SEC] [--pool ADDR:PORT[,N]]... <port>\n";
         return 1;
     }
-    unsigned short port = static_cast<unsigned short>(std::stoi(argv[1]));
+    unsigned short port = static_cast<unsigned short>(std::stoi(argv[argi]));
+    if (!fork) raise_fd_limit();
 
-    boost::asio::io_context io_ctx;
-    Server server(io_ctx, port);
+    Stats::instance();   // 共享記憶體要在 fork 之前建好
+    boost::asio::io_context io_ctx(threads);
+    FairScheduler scheduler(io_ctx);
+    fair_scheduler = &scheduler;
+    DnsCache dns(io_ctx);
+    if (!hosts.empty() && !dns.load_hosts(hosts))
+        std::cerr << "dns: cannot read " << hosts << "\n";
+    dns_cache = &dns;
+
+    std::unique_ptr<ConnectionPool> warm;
+    if (!pools.empty() && fork) {
+        std::cerr << "pool: ignored without --no-fork/--threads\n";
+    } else if (!pools.empty()) {
+        warm = std::make_unique<ConnectionPool>(io_ctx);
+        for (auto& p : pools) warm->add(p.first, p.second);
+        connection_pool = warm.get();
+    }
+    Server server(io_ctx, port, fork, stats_port);
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i)
+        pool.emplace_back([&io_ctx]{ io_ctx.run(); });
     io_ctx.run();
+    for (auto& t : pool) t.join();
     return 0;
 }
\ No newline at end of file
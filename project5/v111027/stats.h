@@ -0,0 +1,160 @@
+// stats.h
+// socks_server 的統計：計數器都是 lock-free 的 atomic，放在 fork 之前 mmap 的共享記憶體裡，
+// 每個 child 直接加到同一份，parent 的 --stats 端點讀出來就是全部 process 的總和。
+// 輸出是 Prometheus 的 text exposition format。
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <new>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+
+// 拒絕的原因，對應 socks_rejects_total{reason=...}
+enum class Reject { auth, unsupported, resolve, firewall, connect, bind };
+constexpr int reject_kinds = 6;
+
+namespace stats_bounds {
+// connect 花多久（µs）
+constexpr std::array<uint64_t, 11> connect_us = {{
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 5000000 }};
+// tunnel 活多久（ms）
+constexpr std::array<uint64_t, 8> duration_ms = {{
+    100, 1000, 10000, 60000, 300000, 1800000, 3600000, 86400000 }};
+// 一條 tunnel 兩個方向總共搬了多少 bytes
+constexpr std::array<uint64_t, 8> tunnel_bytes = {{
+    1 << 10, 16 << 10, 256 << 10, 1 << 20, 16 << 20, 256 << 20, 1ull << 30, 16ull << 30 }};
+} // namespace stats_bounds
+
+// 每個 bucket 各自計數（不是累積的），輸出時才累加；最後一格是 +Inf
+template <size_t N>
+struct Histogram {
+    std::atomic<uint64_t> bucket[N + 1];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+
+    void observe(uint64_t v, const std::array<uint64_t, N>& bounds) {
+        size_t i = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+        bucket[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    // scale: 內部單位換成輸出單位（例如 µs -> 秒是 1e-6）
+    void render(std::ostream& os, const char* name, const char* help,
+                const std::array<uint64_t, N>& bounds, double scale) const {
+        // scale 是 1 就照整數輸出，不然大的數字會變成 1.04858e+06
+        auto put = [&](uint64_t v) {
+            if (scale == 1) os << v;
+            else            os << std::setprecision(12) << v * scale;
+        };
+        os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " histogram\n";
+        uint64_t total = 0;
+        for (size_t i = 0; i <= N; ++i) {
+            total += bucket[i].load(std::memory_order_relaxed);
+            os << name << "_bucket{le=\"";
+            if (i < N) put(bounds[i]);
+            else       os << "+Inf";
+            os << "\"} " << total << '\n';
+        }
+        os << name << "_sum ";
+        put(sum.load(std::memory_order_relaxed));
+        os << '\n' << name << "_count " << count.load(std::memory_order_relaxed) << '\n';
+    }
+};
+
+struct Stats {
+    std::atomic<uint64_t> requests[2][4];     // [SOCKS4, SOCKS5][CONNECT, BIND, UDP ASSOCIATE, 其他]
+    std::atomic<uint64_t> rejects[reject_kinds];
+    std::atomic<int64_t>  sessions_active;    // 已經開始讀 request 的 client 連線
+    std::atomic<int64_t>  tunnels_active;
+    std::atomic<uint64_t> tunnels_total;
+    std::atomic<uint64_t> bytes[2];           // [client -> remote, remote -> client]
+    std::atomic<uint64_t> datagrams[2];       // UDP ASSOCIATE，方向同上
+    std::atomic<uint64_t> pool_hits;          // CONNECT 直接用了 --pool 先連好的連線
+    Histogram<11> connect_latency;            // µs
+    Histogram<8>  tunnel_duration;            // ms
+    Histogram<8>  tunnel_bytes;
+
+    static void add(std::atomic<uint64_t>& c, uint64_t n = 1) {
+        c.fetch_add(n, std::memory_order_relaxed);
+    }
+    static void add(std::atomic<int64_t>& g, int64_t n) {
+        g.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void reject(Reject why) { add(rejects[static_cast<int>(why)]); }
+
+    // 第一次呼叫時建立；必須在 fork 之前（main 一開始）呼叫，child 才會共用同一份。
+    // MAP_ANONYMOUS 的記憶體是全 0，atomic 不用另外初始化
+    static Stats& instance() {
+        static Stats* s = [] {
+            void* p = ::mmap(nullptr, sizeof(Stats), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) return new Stats();   // 只剩這個 process 自己的
+            return new (p) Stats;
+        }();
+        return *s;
+    }
+
+    std::string render() const {
+        static const char* versions[2] = { "4", "5" };
+        static const char* commands[4] = { "connect", "bind", "udp_associate", "other" };
+        static const char* reasons[reject_kinds] = {
+            "auth", "unsupported", "resolve", "firewall", "connect", "bind" };
+        static const char* directions[2] = { "up", "down" };
+        auto get = [](const auto& a) { return a.load(std::memory_order_relaxed); };
+
+        std::ostringstream os;
+        os << "# HELP socks_requests_total Requests by protocol version and command.\n"
+              "# TYPE socks_requests_total counter\n";
+        for (int v = 0; v < 2; ++v)
+            for (int c = 0; c < 4; ++c)
+                os << "socks_requests_total{version=\"" << versions[v] << "\",command=\""
+                   << commands[c] << "\"} " << get(requests[v][c]) << '\n';
+
+        os << "# HELP socks_rejects_total Rejected requests by reason.\n"
+              "# TYPE socks_rejects_total counter\n";
+        for (int r = 0; r < reject_kinds; ++r)
+            os << "socks_rejects_total{reason=\"" << reasons[r] << "\"} " << get(rejects[r]) << '\n';
+
+        os << "# HELP socks_sessions_active Client connections currently being served.\n"
+              "# TYPE socks_sessions_active gauge\n"
+              "socks_sessions_active " << get(sessions_active) << '\n'
+           << "# HELP socks_tunnels_active Established CONNECT/BIND/UDP tunnels.\n"
+              "# TYPE socks_tunnels_active gauge\n"
+              "socks_tunnels_active " << get(tunnels_active) << '\n'
+           << "# HELP socks_tunnels_total Tunnels established since start.\n"
+              "# TYPE socks_tunnels_total counter\n"
+              "socks_tunnels_total " << get(tunnels_total) << '\n'
+           << "# HELP socks_pool_hits_total CONNECTs served from the warm connection pool.\n"
+              "# TYPE socks_pool_hits_total counter\n"
+              "socks_pool_hits_total " << get(pool_hits) << '\n';
+
+        os << "# HELP socks_bytes_total Bytes relayed; up is client to remote.\n"
+              "# TYPE socks_bytes_total counter\n";
+        for (int d = 0; d < 2; ++d)
+            os << "socks_bytes_total{direction=\"" << directions[d] << "\"} " << get(bytes[d]) << '\n';
+        os << "# HELP socks_udp_datagrams_total Datagrams relayed for UDP ASSOCIATE.\n"
+              "# TYPE socks_udp_datagrams_total counter\n";
+        for (int d = 0; d < 2; ++d)
+            os << "socks_udp_datagrams_total{direction=\"" << directions[d] << "\"} "
+               << get(datagrams[d]) << '\n';
+
+        connect_latency.render(os, "socks_connect_latency_seconds",
+            "Time to connect to the destination.", stats_bounds::connect_us, 1e-6);
+        tunnel_duration.render(os, "socks_tunnel_duration_seconds",
+            "Lifetime of closed tunnels.", stats_bounds::duration_ms, 1e-3);
+        tunnel_bytes.render(os, "socks_tunnel_bytes",
+            "Bytes relayed per closed tunnel, both directions.", stats_bounds::tunnel_bytes, 1);
+        return os.str();
+    }
+};
+
+#endif